@@ -0,0 +1,240 @@
+//! Benchmarks of reader, writer and tabix paths
+//!
+//! Run with `cargo bench`. Under `cargo test` each benchmark runs once with small data as a smoke test.
+
+use bgzip::tabix::Tabix;
+use bgzip::{BGZFReader, BGZFWriter, RecordReader};
+use std::fs::File;
+use std::io::{self, BufRead, Read, Write};
+use std::time::{Duration, Instant};
+
+const TEST_FILE: &str = "testfiles/common_all_20180418_half.vcf.gz";
+const TEST_INDEX: &str = "testfiles/common_all_20180418_half.vcf.gz.tbi";
+
+struct Bencher {
+    /// Run each benchmark only once for `cargo test`
+    smoke: bool,
+    filter: Option<String>,
+}
+
+impl Bencher {
+    /// Run `f` repeatedly and print median time per iteration. `bytes` is processed data size per iteration.
+    fn run<F: FnMut() -> io::Result<()>>(
+        &self,
+        name: &str,
+        bytes: Option<u64>,
+        mut f: F,
+    ) -> io::Result<()> {
+        if let Some(filter) = self.filter.as_ref() {
+            if !name.contains(filter.as_str()) {
+                return Ok(());
+            }
+        }
+        if self.smoke {
+            f()?;
+            println!("{} ... ok", name);
+            return Ok(());
+        }
+
+        // Warm up and estimate iterations for about 3 seconds
+        let start = Instant::now();
+        f()?;
+        let once = start.elapsed().max(Duration::from_micros(1));
+        let iterations = (Duration::from_secs(3).as_nanos() / once.as_nanos()).max(5) as usize;
+
+        let mut times = Vec::with_capacity(iterations);
+        for _ in 0..iterations {
+            let start = Instant::now();
+            f()?;
+            times.push(start.elapsed());
+        }
+        times.sort();
+        let median = times[times.len() / 2];
+        match bytes {
+            Some(bytes) => println!(
+                "{:<40} {:>12.3?} / iter  {:>9.1} MiB/s  ({} iterations)",
+                name,
+                median,
+                bytes as f64 / median.as_secs_f64() / 1024. / 1024.,
+                iterations
+            ),
+            None => println!(
+                "{:<40} {:>12.3?} / iter  ({} iterations)",
+                name, median, iterations
+            ),
+        }
+        Ok(())
+    }
+}
+
+/// Generate VCF-like lines of about `size` bytes.
+fn synthetic_vcf(size: usize) -> io::Result<Vec<u8>> {
+    let mut data = Vec::with_capacity(size + 200);
+    data.extend_from_slice(
+        b"##fileformat=VCFv4.2\n#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n",
+    );
+    let mut state: u64 = 0x2545_f491_4f6c_dd1d;
+    let mut position = 10000;
+    while data.len() < size {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        position += state % 300 + 1;
+        let bases = b"ACGT";
+        writeln!(
+            data,
+            "1\t{}\trs{}\t{}\t{}\t.\t.\tRS={};dbSNPBuildID={};AF={:.4}",
+            position,
+            state % 100_000_000,
+            bases[(state % 4) as usize] as char,
+            bases[((state >> 2) % 4) as usize] as char,
+            state % 100_000_000,
+            100 + state % 50,
+            (state % 10000) as f64 / 10000.
+        )?;
+    }
+    Ok(data)
+}
+
+fn compress(data: &[u8], level: flate2::Compression, block_size: usize) -> io::Result<Vec<u8>> {
+    let mut compressed = Vec::new();
+    let mut writer = BGZFWriter::new(&mut compressed, level);
+    writer.set_block_size(block_size)?;
+    writer.write_all(data)?;
+    writer.close()?;
+    Ok(compressed)
+}
+
+/// Virtual offsets of starts of blocks
+fn block_offsets(compressed: &[u8]) -> io::Result<Vec<u64>> {
+    let mut reader = BGZFReader::new(io::Cursor::new(compressed));
+    let mut offsets = Vec::new();
+    loop {
+        let position = reader.bgzf_pos();
+        let length = reader.fill_buf()?.len();
+        if length == 0 {
+            break;
+        }
+        offsets.push(position);
+        reader.consume(length);
+    }
+    Ok(offsets)
+}
+
+fn main() -> io::Result<()> {
+    let args: Vec<String> = std::env::args().skip(1).collect();
+    let bencher = Bencher {
+        smoke: !args.iter().any(|x| x == "--bench"),
+        filter: args.iter().find(|x| !x.starts_with("--")).cloned(),
+    };
+
+    let test_file = std::fs::read(TEST_FILE)?;
+    let mut test_data = Vec::new();
+    flate2::read::MultiGzDecoder::new(&test_file[..]).read_to_end(&mut test_data)?;
+    let synthetic = synthetic_vcf(if bencher.smoke { 1 << 20 } else { 64 << 20 })?;
+    let synthetic_file = compress(&synthetic, flate2::Compression::default(), 0xff00)?;
+
+    for (name, compressed, data) in [
+        ("test file", &test_file, &test_data),
+        ("synthetic", &synthetic_file, &synthetic),
+    ]
+    .iter()
+    {
+        let size = Some(data.len() as u64);
+        bencher.run(&format!("read_line {}", name), size, || {
+            let mut reader = BGZFReader::new(io::Cursor::new(compressed));
+            let mut line = String::new();
+            while reader.read_line(&mut line)? > 0 {
+                line.clear();
+            }
+            Ok(())
+        })?;
+        bencher.run(&format!("next_record {}", name), size, || {
+            let mut records = RecordReader::new(BGZFReader::new(io::Cursor::new(compressed)));
+            while records.next_record()?.is_some() {}
+            Ok(())
+        })?;
+        bencher.run(&format!("read {}", name), size, || {
+            let mut reader = BGZFReader::new(io::Cursor::new(compressed));
+            let mut buffer = vec![0; 64 * 1024];
+            while reader.read(&mut buffer)? > 0 {}
+            Ok(())
+        })?;
+        bencher.run(&format!("read 4 threads {}", name), size, || {
+            let mut reader = BGZFReader::with_threads(io::Cursor::new(compressed), 4);
+            io::copy(&mut reader, &mut io::sink())?;
+            Ok(())
+        })?;
+    }
+
+    let offsets = block_offsets(&synthetic_file)?;
+    let seek_targets: Vec<u64> = (0..100)
+        .map(|i| offsets[(i * 7919) % offsets.len()] + 100)
+        .collect();
+    bencher.run("bgzf_seek cold cache x100", None, || {
+        let mut reader = BGZFReader::new(io::Cursor::new(&synthetic_file));
+        reader.set_cache_limit(1);
+        let mut line = Vec::new();
+        for one in &seek_targets {
+            reader.bgzf_seek(*one).map_err(to_io)?;
+            line.clear();
+            reader.read_until(b'\n', &mut line)?;
+        }
+        Ok(())
+    })?;
+    let mut warm_reader = BGZFReader::new(io::Cursor::new(&synthetic_file));
+    warm_reader.set_cache_limit(seek_targets.len());
+    bencher.run("bgzf_seek warm cache x100", None, || {
+        let mut line = Vec::new();
+        for one in &seek_targets {
+            warm_reader.bgzf_seek(*one).map_err(to_io)?;
+            line.clear();
+            warm_reader.read_until(b'\n', &mut line)?;
+        }
+        Ok(())
+    })?;
+
+    let writer_data = &synthetic[..synthetic.len().min(16 << 20)];
+    for (level_name, level) in [
+        ("none", flate2::Compression::none()),
+        ("fast", flate2::Compression::fast()),
+        ("default", flate2::Compression::default()),
+        ("best", flate2::Compression::best()),
+    ]
+    .iter()
+    {
+        for block_size in [0xff00, 0x4000].iter() {
+            bencher.run(
+                &format!("write level={} block={}", level_name, block_size),
+                Some(writer_data.len() as u64),
+                || compress(writer_data, *level, *block_size).map(|_| ()),
+            )?;
+        }
+    }
+    bencher.run("write 4 threads", Some(writer_data.len() as u64), || {
+        let mut writer = BGZFWriter::with_threads(io::sink(), flate2::Compression::default(), 4);
+        writer.write_all(writer_data)?;
+        writer.close()
+    })?;
+
+    let index = std::fs::read(TEST_INDEX)?;
+    bencher.run("Tabix::from_reader", Some(index.len() as u64), || {
+        Tabix::from_reader(&mut &index[..])?;
+        Ok(())
+    })?;
+    let tabix = Tabix::from_reader(&mut File::open(TEST_INDEX)?)?;
+    bencher.run("Tabix::query_records", None, || {
+        let mut reader = BGZFReader::new(io::Cursor::new(&test_file));
+        let sequence_id = tabix.sequence_id(b"1").unwrap();
+        for one in tabix.query_records(&mut reader, sequence_id, 1_000_000, 20_000_000) {
+            one?;
+        }
+        Ok(())
+    })?;
+
+    Ok(())
+}
+
+fn to_io(e: bgzip::BGZFError) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, e)
+}
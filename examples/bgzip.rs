@@ -1,4 +1,4 @@
-use bgzip::{BGZFError, BGZFWriter};
+use bgzip::{decompress_parallel, BGZFError, BGZFStreamReader, BGZFWriter};
 use clap::{App, Arg};
 use std::fs;
 use std::io;
@@ -61,6 +61,13 @@ fn main() -> Result<(), BGZFError> {
                 .long("force")
                 .help("overwrite existing file"),
         )
+        .arg(
+            Arg::with_name("threads")
+                .short("@")
+                .long("threads")
+                .takes_value(true)
+                .help("number of compression or decompression threads to use"),
+        )
         .arg(
             Arg::with_name("files")
                 .index(1)
@@ -77,6 +84,15 @@ fn main() -> Result<(), BGZFError> {
         flate2::Compression::default()
     };
 
+    let threads: usize = matches
+        .value_of("threads")
+        .map(|x| x.parse())
+        .transpose()
+        .map_err(|_| BGZFError::Other {
+            message: "invalid number of threads",
+        })?
+        .unwrap_or(1);
+
     let stdin = io::stdin();
     let stdout = io::stdout();
 
@@ -137,12 +153,18 @@ fn main() -> Result<(), BGZFError> {
 
         match mode {
             Mode::Decompress => {
-                //println!("decompress");
-                let mut reader = flate2::bufread::MultiGzDecoder::new(input);
-                io::copy(&mut reader, &mut output)?;
+                if !is_bgzf(input.fill_buf()?) {
+                    let mut reader = flate2::bufread::MultiGzDecoder::new(input);
+                    io::copy(&mut reader, &mut output)?;
+                } else if threads > 1 {
+                    decompress_parallel(input, output, threads)?;
+                } else {
+                    let mut reader = BGZFStreamReader::new(input);
+                    io::copy(&mut reader, &mut output)?;
+                }
             }
             Mode::Compress => {
-                let mut writer = BGZFWriter::new(output, level);
+                let mut writer = BGZFWriter::with_threads(output, level, threads);
                 io::copy(&mut input, &mut writer)?;
             }
         }
@@ -150,3 +172,8 @@ fn main() -> Result<(), BGZFError> {
 
     Ok(())
 }
+
+/// Check whether `data` starts with a BGZF block header. Other gzip files are decompressed with flate2.
+fn is_bgzf(data: &[u8]) -> bool {
+    data.len() >= 16 && data[..4] == [31, 139, 8, 4] && data[12..16] == [66, 67, 2, 0]
+}
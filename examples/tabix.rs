@@ -0,0 +1,167 @@
+use bgzip::tabix::{self, TabixBuilder};
+use bgzip::BGZFError;
+use clap::{App, Arg};
+use std::fs;
+use std::path::Path;
+
+fn main() -> Result<(), BGZFError> {
+    let matches = App::new("tabix")
+        .version("0.1.0")
+        .author("Okamura, Yasunobu")
+        .about("Create TBI or CSI index of BGZF compressed tab-delimited files")
+        .arg(
+            Arg::with_name("preset")
+                .short("p")
+                .long("preset")
+                .takes_value(true)
+                .possible_values(&["gff", "bed", "sam", "vcf"])
+                .help("gff, bed, sam or vcf"),
+        )
+        .arg(
+            Arg::with_name("sequence")
+                .short("s")
+                .long("sequence")
+                .takes_value(true)
+                .help("column number for sequence names"),
+        )
+        .arg(
+            Arg::with_name("begin")
+                .short("b")
+                .long("begin")
+                .takes_value(true)
+                .help("column number for region start"),
+        )
+        .arg(
+            Arg::with_name("end")
+                .short("e")
+                .long("end")
+                .takes_value(true)
+                .help("column number for region end"),
+        )
+        .arg(
+            Arg::with_name("zero-based")
+                .short("0")
+                .long("zero-based")
+                .help("coordinates are zero-based"),
+        )
+        .arg(
+            Arg::with_name("skip-lines")
+                .short("S")
+                .long("skip-lines")
+                .takes_value(true)
+                .help("skip first N lines"),
+        )
+        .arg(
+            Arg::with_name("comment")
+                .short("c")
+                .long("comment")
+                .takes_value(true)
+                .help("skip comment lines starting with CHAR"),
+        )
+        .arg(
+            Arg::with_name("csi")
+                .short("C")
+                .long("csi")
+                .help("generate CSI index"),
+        )
+        .arg(
+            Arg::with_name("min-shift")
+                .short("m")
+                .long("min-shift")
+                .takes_value(true)
+                .help("set minimal interval size for CSI indices to 2^INT"),
+        )
+        .arg(
+            Arg::with_name("force")
+                .short("f")
+                .long("force")
+                .help("overwrite existing index"),
+        )
+        .arg(
+            Arg::with_name("threads")
+                .short("@")
+                .long("threads")
+                .takes_value(true)
+                .help("number of threads to use"),
+        )
+        .arg(
+            Arg::with_name("files")
+                .index(1)
+                .takes_value(true)
+                .multiple(true)
+                .required(true),
+        )
+        .get_matches();
+
+    let number = |name: &str, message: &'static str| {
+        matches
+            .value_of(name)
+            .map(|x| x.parse::<i32>())
+            .transpose()
+            .map_err(|_| BGZFError::Other { message })
+    };
+    let threads = number("threads", "invalid number of threads")?.unwrap_or(1);
+    let min_shift = number("min-shift", "invalid min shift")?;
+    let csi = matches.is_present("csi") || min_shift.is_some();
+
+    for one in matches.values_of("files").into_iter().flatten() {
+        let preset = matches.value_of("preset").or_else(|| {
+            let name = one.strip_suffix(".gz").unwrap_or(one);
+            ["gff", "bed", "sam", "vcf"]
+                .iter()
+                .copied()
+                .find(|x| name.ends_with(&format!(".{}", x)))
+        });
+        let (mut format, mut sequence, mut begin, mut end, mut meta) = match preset {
+            Some("gff") => (tabix::FORMAT_GENERIC, 1, 4, 5, b'#'),
+            Some("bed") => (
+                tabix::FORMAT_GENERIC | tabix::FORMAT_FLAG_ZERO_BASED,
+                1,
+                2,
+                3,
+                b'#',
+            ),
+            Some("sam") => (tabix::FORMAT_SAM, 3, 4, 0, b'@'),
+            Some("vcf") => (tabix::FORMAT_VCF, 1, 2, 0, b'#'),
+            _ => (tabix::FORMAT_GENERIC, 1, 4, 5, b'#'),
+        };
+        if let Some(x) = number("sequence", "invalid sequence column")? {
+            sequence = x;
+        }
+        if let Some(x) = number("begin", "invalid begin column")? {
+            begin = x;
+        }
+        if let Some(x) = number("end", "invalid end column")? {
+            end = x;
+        }
+        if matches.is_present("zero-based") {
+            format |= tabix::FORMAT_FLAG_ZERO_BASED;
+        }
+        if let Some(x) = matches.value_of("comment") {
+            meta = x.bytes().next().unwrap_or(0);
+        }
+        let skip = number("skip-lines", "invalid number of skip lines")?.unwrap_or(0);
+
+        let mut builder = TabixBuilder::new(format, sequence, begin, end, meta, skip);
+        if csi {
+            let min_shift = min_shift.unwrap_or(tabix::TABIX_MIN_SHIFT);
+            builder.set_binning(min_shift, tabix::binning_depth(min_shift, 1 << 32));
+        }
+
+        let output_filename = format!("{}.{}", one, if csi { "csi" } else { "tbi" });
+        if Path::new(&output_filename).exists() && !matches.is_present("force") {
+            return Err(BGZFError::Other {
+                message: "already exist",
+            });
+        }
+        let index = builder.build_parallel(fs::File::open(one)?, threads.max(1) as usize)?;
+        let output = fs::File::create(output_filename)?;
+        if csi {
+            index.write_csi(output)?;
+        } else {
+            index.write_tbi(output)?;
+        }
+    }
+
+    Ok(())
+}
@@ -0,0 +1,494 @@
+use crate::header::{fixed_header_block_size, BGZFHeader, FLAG_FEXTRA, FLAG_FTEXT};
+use crate::read::BlockDecompressor;
+use crate::slice::find_block;
+use crate::write::{BlockCompressor, COMPRESS_BLOCK_UNIT, FOOTER_BYTES};
+use crate::*;
+use std::collections::VecDeque;
+use std::future::Future;
+use std::io;
+use std::pin::Pin;
+use std::task::{Context, Poll};
+use tokio::io::{AsyncBufRead, AsyncRead, AsyncWrite, ReadBuf};
+use tokio::task::JoinHandle;
+
+/// Return from the poll function if the inner poll is pending.
+macro_rules! ready {
+    ($e:expr) => {
+        match $e {
+            Poll::Ready(x) => x,
+            Poll::Pending => return Poll::Pending,
+        }
+    };
+}
+
+const DEFAULT_BLOCKS_IN_FLIGHT: usize = 4;
+/// Size of fixed gzip header fields until XLEN
+const FIXED_HEADER_SIZE: usize = 12;
+
+fn join_error(e: tokio::task::JoinError) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, e)
+}
+
+fn bgzf_error(e: BGZFError) -> io::Error {
+    match e {
+        BGZFError::IoError(e) => e,
+        e => io::Error::new(io::ErrorKind::InvalidData, e),
+    }
+}
+
+/// Decompressor, buffer of compressed data and result of a block inflated in the blocking thread pool
+type InflateResult = (
+    BlockDecompressor,
+    Vec<u8>,
+    Result<crate::cache::BGZFCache, BGZFError>,
+);
+
+/// An asynchronous BGZF reader for tokio.
+///
+/// Compressed blocks are read from the underlying reader without blocking,
+/// and inflated in the blocking thread pool of tokio runtime while following blocks are read.
+/// This reader must be used within tokio runtime, and does not support seek.
+pub struct AsyncBGZFReader<R: AsyncRead + Unpin> {
+    reader: R,
+    /// Bytes of a block being read
+    raw: Vec<u8>,
+    raw_filled: usize,
+    raw_position: u64,
+    end_of_file: bool,
+    in_flight: VecDeque<JoinHandle<InflateResult>>,
+    blocks_in_flight: usize,
+    decompressors: Vec<BlockDecompressor>,
+    /// Reusable buffers of compressed and inflated blocks
+    buffer_pool: Vec<Vec<u8>>,
+    verify_crc: bool,
+    current: Vec<u8>,
+    current_position: usize,
+}
+
+impl<R: AsyncRead + Unpin> AsyncBGZFReader<R> {
+    /// Create a new BGZF reader from tokio::io::AsyncRead
+    pub fn new(reader: R) -> Self {
+        AsyncBGZFReader::with_blocks_in_flight(reader, DEFAULT_BLOCKS_IN_FLIGHT)
+    }
+
+    /// Create a reader which inflates up to `blocks` blocks in parallel.
+    pub fn with_blocks_in_flight(reader: R, blocks: usize) -> Self {
+        AsyncBGZFReader {
+            reader,
+            raw: Vec::new(),
+            raw_filled: 0,
+            raw_position: 0,
+            end_of_file: false,
+            in_flight: VecDeque::new(),
+            blocks_in_flight: blocks.max(1),
+            decompressors: Vec::new(),
+            buffer_pool: Vec::new(),
+            verify_crc: true,
+            current: Vec::new(),
+            current_position: 0,
+        }
+    }
+
+    /// Enable or disable CRC32 verification of inflated blocks. Enabled by default.
+    ///
+    /// See [`BGZFReader::set_verify_crc`](crate::BGZFReader::set_verify_crc).
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.verify_crc = verify;
+    }
+
+    /// Read a whole block. Returns the block and size of header, or `None` at end of file.
+    fn poll_raw_block(
+        &mut self,
+        cx: &mut Context<'_>,
+    ) -> Poll<io::Result<Option<(Vec<u8>, usize)>>> {
+        loop {
+            let needed = if self.raw_filled < FIXED_HEADER_SIZE {
+                FIXED_HEADER_SIZE
+            } else {
+                if self.raw[3] & FLAG_FEXTRA == 0 {
+                    return Poll::Ready(Err(bgzf_error(BGZFError::NotBGZF)));
+                }
+                let extra_length = u16::from_le_bytes([self.raw[10], self.raw[11]]) as usize;
+                let extra_end = FIXED_HEADER_SIZE + extra_length;
+                if self.raw_filled < extra_end {
+                    extra_end
+                } else {
+                    let block_size = match fixed_header_block_size(&self.raw[..extra_end]) {
+                        Some(block_size) => block_size,
+                        None => {
+                            // BSIZE is in the extra field, which is before file name, comment and header CRC
+                            let mut extra_header = self.raw[..extra_end].to_vec();
+                            extra_header[3] &= FLAG_FTEXT | FLAG_FEXTRA;
+                            let header = BGZFHeader::from_reader(&mut &extra_header[..])
+                                .map_err(bgzf_error)?;
+                            header.block_size().map_err(bgzf_error)? as usize + 1
+                        }
+                    };
+                    if block_size < extra_end + 8 {
+                        return Poll::Ready(Err(io::Error::new(
+                            io::ErrorKind::InvalidData,
+                            "Invalid block size",
+                        )));
+                    }
+                    if self.raw_filled == block_size {
+                        // The whole header including optional fields is parsed again to find deflate data
+                        let header_size =
+                            match find_block(&self.raw[..block_size]).map_err(bgzf_error)? {
+                                Some((header_size, _)) => header_size,
+                                None => {
+                                    return Poll::Ready(Err(io::Error::new(
+                                        io::ErrorKind::InvalidData,
+                                        "Invalid block size",
+                                    )))
+                                }
+                            };
+                        let next_raw = self.take_buffer();
+                        let mut raw = std::mem::replace(&mut self.raw, next_raw);
+                        raw.truncate(block_size);
+                        self.raw_filled = 0;
+                        return Poll::Ready(Ok(Some((raw, header_size))));
+                    }
+                    block_size
+                }
+            };
+
+            if self.raw.len() < needed {
+                self.raw.resize(needed, 0);
+            }
+            let mut buf = ReadBuf::new(&mut self.raw[self.raw_filled..needed]);
+            ready!(Pin::new(&mut self.reader).poll_read(cx, &mut buf))?;
+            let read_length = buf.filled().len();
+            if read_length == 0 {
+                return if self.raw_filled == 0 {
+                    Poll::Ready(Ok(None))
+                } else {
+                    Poll::Ready(Err(io::Error::new(
+                        io::ErrorKind::UnexpectedEof,
+                        "Unexpected end of BGZF block",
+                    )))
+                };
+            }
+            self.raw_filled += read_length;
+        }
+    }
+
+    /// Read following blocks and pass them to the blocking thread pool.
+    fn poll_submit(&mut self, cx: &mut Context<'_>) -> io::Result<()> {
+        while !self.end_of_file && self.in_flight.len() < self.blocks_in_flight {
+            match self.poll_raw_block(cx) {
+                Poll::Ready(Ok(Some((raw, header_size)))) => {
+                    let position = self.raw_position;
+                    let next_position = position + raw.len() as u64;
+                    self.raw_position = next_position;
+                    let mut decompressor = self
+                        .decompressors
+                        .pop()
+                        .unwrap_or_else(BlockDecompressor::new);
+                    decompressor.set_verify_crc(self.verify_crc);
+                    let buffer = self.take_buffer();
+                    self.in_flight
+                        .push_back(tokio::task::spawn_blocking(move || {
+                            let result = decompressor.decompress(
+                                position,
+                                next_position,
+                                &raw[header_size..],
+                                buffer,
+                            );
+                            (decompressor, raw, result)
+                        }));
+                }
+                Poll::Ready(Ok(None)) => self.end_of_file = true,
+                Poll::Ready(Err(e)) => return Err(e),
+                Poll::Pending => break,
+            }
+        }
+        Ok(())
+    }
+
+    fn take_buffer(&mut self) -> Vec<u8> {
+        self.buffer_pool.pop().unwrap_or_default()
+    }
+
+    fn recycle_buffer(&mut self, mut buffer: Vec<u8>) {
+        buffer.clear();
+        self.buffer_pool.push(buffer);
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncBufRead for AsyncBGZFReader<R> {
+    fn poll_fill_buf(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<&[u8]>> {
+        let this = self.get_mut();
+        while this.current_position >= this.current.len() {
+            this.poll_submit(cx)?;
+            if let Some(front) = this.in_flight.front_mut() {
+                let (decompressor, raw, result) =
+                    ready!(Pin::new(front).poll(cx)).map_err(join_error)?;
+                this.in_flight.pop_front();
+                this.decompressors.push(decompressor);
+                this.recycle_buffer(raw);
+                let block = result.map_err(bgzf_error)?;
+                let current = match block.buffer {
+                    crate::cache::BlockData::Owned(x) => x,
+                    crate::cache::BlockData::Shared(x) => x.to_vec(),
+                };
+                let previous = std::mem::replace(&mut this.current, current);
+                this.recycle_buffer(previous);
+                this.current_position = 0;
+            } else if this.end_of_file {
+                return Poll::Ready(Ok(&[]));
+            } else {
+                return Poll::Pending;
+            }
+        }
+        Poll::Ready(Ok(&this.current[this.current_position..]))
+    }
+
+    fn consume(self: Pin<&mut Self>, amt: usize) {
+        let this = self.get_mut();
+        this.current_position = (this.current_position + amt).min(this.current.len());
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for AsyncBGZFReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<io::Result<()>> {
+        let available = ready!(self.as_mut().poll_fill_buf(cx))?;
+        let length = available.len().min(buf.remaining());
+        buf.put_slice(&available[..length]);
+        self.consume(length);
+        Poll::Ready(Ok(()))
+    }
+}
+
+type DeflateResult = (BlockCompressor, Vec<u8>, io::Result<Vec<u8>>);
+
+/// An asynchronous BGZF writer for tokio.
+///
+/// Blocks are compressed in the blocking thread pool of tokio runtime and written in order without blocking.
+/// This writer must be used within tokio runtime.
+/// Call `shutdown` to write remaining blocks and end-of-file marker.
+pub struct AsyncBGZFWriter<W: AsyncWrite + Unpin> {
+    writer: W,
+    level: flate2::Compression,
+    buffer: Vec<u8>,
+    in_flight: VecDeque<JoinHandle<DeflateResult>>,
+    blocks_in_flight: usize,
+    compressors: Vec<BlockCompressor>,
+    buffer_pool: Vec<Vec<u8>>,
+    /// Reusable buffers of compressed blocks
+    block_pool: Vec<Vec<u8>>,
+    /// Compressed block being written and written length
+    output: Option<(Vec<u8>, usize)>,
+    closed: bool,
+}
+
+impl<W: AsyncWrite + Unpin> AsyncBGZFWriter<W> {
+    /// Create a new BGZF writer from tokio::io::AsyncWrite
+    pub fn new(writer: W, level: flate2::Compression) -> Self {
+        AsyncBGZFWriter::with_blocks_in_flight(writer, level, DEFAULT_BLOCKS_IN_FLIGHT)
+    }
+
+    /// Create a writer which compresses up to `blocks` blocks in parallel.
+    pub fn with_blocks_in_flight(writer: W, level: flate2::Compression, blocks: usize) -> Self {
+        AsyncBGZFWriter {
+            writer,
+            level,
+            buffer: Vec::with_capacity(COMPRESS_BLOCK_UNIT),
+            in_flight: VecDeque::new(),
+            blocks_in_flight: blocks.max(1),
+            compressors: Vec::new(),
+            buffer_pool: Vec::new(),
+            block_pool: Vec::new(),
+            output: None,
+            closed: false,
+        }
+    }
+
+    /// Pass buffered data to the blocking thread pool.
+    fn submit(&mut self) {
+        let next_buffer = self
+            .buffer_pool
+            .pop()
+            .unwrap_or_else(|| Vec::with_capacity(COMPRESS_BLOCK_UNIT));
+        let data = std::mem::replace(&mut self.buffer, next_buffer);
+        let level = self.level;
+        let mut compressor = self
+            .compressors
+            .pop()
+            .unwrap_or_else(|| BlockCompressor::new(level));
+        let mut block = self.block_pool.pop().unwrap_or_default();
+        self.in_flight
+            .push_back(tokio::task::spawn_blocking(move || {
+                let result = compressor.compress(&data, &mut block).map(|_| block);
+                (compressor, data, result)
+            }));
+    }
+
+    /// Write compressed blocks until fewer than `limit` blocks are in flight.
+    /// Blocks already compressed are written even if `limit` is satisfied.
+    fn poll_drain(&mut self, cx: &mut Context<'_>, limit: usize) -> Poll<io::Result<()>> {
+        loop {
+            if let Some((block, written)) = self.output.as_mut() {
+                let length = ready!(Pin::new(&mut self.writer).poll_write(cx, &block[*written..]))?;
+                if length == 0 {
+                    return Poll::Ready(Err(io::ErrorKind::WriteZero.into()));
+                }
+                *written += length;
+                if *written == block.len() {
+                    let (mut block, _) = self.output.take().unwrap();
+                    block.clear();
+                    self.block_pool.push(block);
+                }
+            } else if let Some(front) = self.in_flight.front_mut() {
+                match Pin::new(front).poll(cx) {
+                    Poll::Ready(result) => {
+                        let (compressor, mut data, result) = result.map_err(join_error)?;
+                        self.in_flight.pop_front();
+                        self.compressors.push(compressor);
+                        data.clear();
+                        self.buffer_pool.push(data);
+                        self.output = Some((result?, 0));
+                    }
+                    Poll::Pending if self.in_flight.len() >= limit => return Poll::Pending,
+                    Poll::Pending => return Poll::Ready(Ok(())),
+                }
+            } else {
+                return Poll::Ready(Ok(()));
+            }
+        }
+    }
+
+    /// Submit buffered data and write all blocks.
+    fn poll_write_blocks(&mut self, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        if !self.buffer.is_empty() {
+            ready!(self.poll_drain(cx, self.blocks_in_flight))?;
+            self.submit();
+        }
+        self.poll_drain(cx, 0)
+    }
+}
+
+impl<W: AsyncWrite + Unpin> AsyncWrite for AsyncBGZFWriter<W> {
+    fn poll_write(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &[u8],
+    ) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        if this.closed {
+            return Poll::Ready(Err(io::Error::new(
+                io::ErrorKind::Other,
+                "BGZF writer is already closed",
+            )));
+        }
+        ready!(this.poll_drain(cx, this.blocks_in_flight))?;
+        let length = buf.len().min(COMPRESS_BLOCK_UNIT - this.buffer.len());
+        this.buffer.extend_from_slice(&buf[..length]);
+        if this.buffer.len() == COMPRESS_BLOCK_UNIT {
+            this.submit();
+        }
+        Poll::Ready(Ok(length))
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        ready!(this.poll_write_blocks(cx))?;
+        Pin::new(&mut this.writer).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        if !this.closed {
+            ready!(this.poll_write_blocks(cx))?;
+            this.output = Some((FOOTER_BYTES.to_vec(), 0));
+            this.closed = true;
+        }
+        ready!(this.poll_drain(cx, 0))?;
+        Pin::new(&mut this.writer).poll_shutdown(cx)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs::File;
+    use std::io::Read;
+    use tokio::io::{AsyncBufReadExt, AsyncReadExt, AsyncWriteExt};
+
+    fn runtime() -> tokio::runtime::Runtime {
+        tokio::runtime::Builder::new_current_thread()
+            .build()
+            .unwrap()
+    }
+
+    #[test]
+    fn test_async_read() -> io::Result<()> {
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut expected)?;
+        let compressed = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+
+        runtime().block_on(async {
+            let mut reader = AsyncBGZFReader::new(&compressed[..]);
+            let mut line = String::new();
+            reader.read_line(&mut line).await?;
+            assert_eq!(line, "##fileformat=VCFv4.0\n");
+            let mut data = line.into_bytes();
+            reader.read_to_end(&mut data).await?;
+            assert_eq!(data, expected);
+
+            let mut truncated = AsyncBGZFReader::new(&compressed[..1000]);
+            assert!(truncated.read_to_end(&mut Vec::new()).await.is_err());
+            io::Result::Ok(())
+        })?;
+
+        // A block with file name and comment after the extra field
+        let mut block = Vec::new();
+        let mut writer = BGZFWriter::new(&mut block, flate2::Compression::default());
+        std::io::Write::write_all(&mut writer, b"hello\n")?;
+        writer.close()?;
+        block.truncate(block.len() - FOOTER_BYTES.len());
+        block[3] |= crate::header::FLAG_FNAME | crate::header::FLAG_FCOMMENT;
+        block.splice(18..18, b"name\0comment\0".iter().copied());
+        let block_size = (block.len() - 1) as u16;
+        block[16..18].copy_from_slice(&block_size.to_le_bytes());
+        block.extend_from_slice(FOOTER_BYTES);
+        runtime().block_on(async {
+            let mut data = Vec::new();
+            AsyncBGZFReader::new(&block[..])
+                .read_to_end(&mut data)
+                .await?;
+            assert_eq!(data, b"hello\n");
+            Ok(())
+        })
+    }
+
+    #[test]
+    fn test_async_write() -> io::Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut data)?;
+
+        let compressed = runtime().block_on(async {
+            let mut compressed = Vec::new();
+            let mut writer = AsyncBGZFWriter::new(&mut compressed, flate2::Compression::default());
+            for one in data.chunks(10000) {
+                writer.write_all(one).await?;
+            }
+            writer.shutdown().await?;
+            assert!(writer.write_all(b"x").await.is_err());
+            io::Result::Ok(compressed)
+        })?;
+
+        // Same as the output of synchronous writer
+        let mut expected = Vec::new();
+        let mut writer = BGZFWriter::new(&mut expected, flate2::Compression::default());
+        std::io::Write::write_all(&mut writer, &data)?;
+        writer.close()?;
+        assert_eq!(compressed, expected);
+        Ok(())
+    }
+}
@@ -0,0 +1,176 @@
+use crate::header::{
+    fixed_header_block_size, BGZFHeader, BGZF_HEADER_SIZE, FLAG_FCOMMENT, FLAG_FEXTRA, FLAG_FHCRC,
+    FLAG_FNAME,
+};
+use crate::*;
+use std::convert::TryInto;
+use std::io::{self, BufRead};
+
+/// A compressed BGZF block including header, compressed data, CRC32 and size.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct BGZFRawBlock {
+    /// Offset of this block in the compressed file
+    pub position: u64,
+    /// Whole bytes of this block
+    pub data: Vec<u8>,
+}
+
+impl BGZFRawBlock {
+    /// Size of uncompressed data stored in the footer
+    pub fn uncompressed_size(&self) -> u32 {
+        u32::from_le_bytes(self.data[(self.data.len() - 4)..].try_into().unwrap())
+    }
+
+    /// Returns `true` if this block contains no data, such as an end-of-file marker.
+    pub fn is_empty(&self) -> bool {
+        self.uncompressed_size() == 0
+    }
+
+    /// Offset of the next block in the compressed file
+    pub fn next_position(&self) -> u64 {
+        self.position + self.data.len() as u64
+    }
+}
+
+/// An iterator over compressed blocks of BGZF data.
+///
+/// Blocks are found with sizes in their headers and returned without inflating,
+/// for example to copy blocks into another file with [`BGZFWriter::write_raw_block`].
+/// ```
+/// use bgzip::BGZFBlocks;
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let file = std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+/// let mut size = 0;
+/// for block in BGZFBlocks::new(std::io::BufReader::new(file)) {
+///     size += u64::from(block?.uncompressed_size());
+/// }
+/// assert_eq!(size, 17_229_639);
+/// # Ok(())
+/// # }
+/// ```
+pub struct BGZFBlocks<R: BufRead> {
+    reader: R,
+    position: u64,
+    finished: bool,
+}
+
+impl<R: BufRead> BGZFBlocks<R> {
+    /// Create an iterator over blocks of `reader` from the beginning of BGZF data
+    pub fn new(reader: R) -> Self {
+        BGZFBlocks::with_position(reader, 0)
+    }
+
+    /// Create an iterator over blocks of `reader` which is already at the compressed file offset `position`.
+    pub fn with_position(reader: R, position: u64) -> Self {
+        BGZFBlocks {
+            reader,
+            position,
+            finished: false,
+        }
+    }
+
+    /// Read the next block. Returns `None` at end of file.
+    pub fn next_block(&mut self) -> Result<Option<BGZFRawBlock>, BGZFError> {
+        let buf = self.reader.fill_buf()?;
+        if buf.is_empty() {
+            return Ok(None);
+        }
+        if let Some(block_size) = fixed_header_block_size(buf) {
+            let mut data = Vec::with_capacity(block_size);
+            data.extend_from_slice(&buf[..BGZF_HEADER_SIZE]);
+            self.reader.consume(BGZF_HEADER_SIZE);
+            return self.read_block(data, BGZF_HEADER_SIZE, block_size);
+        }
+
+        // Collect header bytes, then parse them
+        let mut data = vec![0; 10];
+        self.reader.read_exact(&mut data)?;
+        let flags = data[3];
+        if flags & FLAG_FEXTRA != 0 {
+            self.read_bytes(&mut data, 2)?;
+            let extra_length = u16::from_le_bytes([data[10], data[11]]);
+            self.read_bytes(&mut data, extra_length.into())?;
+        }
+        if flags & FLAG_FNAME != 0 {
+            self.reader.read_until(0, &mut data)?;
+        }
+        if flags & FLAG_FCOMMENT != 0 {
+            self.reader.read_until(0, &mut data)?;
+        }
+        if flags & FLAG_FHCRC != 0 {
+            self.read_bytes(&mut data, 2)?;
+        }
+        let header = BGZFHeader::from_reader(&mut &data[..])?;
+        let header_size = data.len();
+        self.read_block(data, header_size, header.block_size()? as usize + 1)
+    }
+
+    /// Read the rest of a block after the header bytes in `data`
+    fn read_block(
+        &mut self,
+        mut data: Vec<u8>,
+        header_size: usize,
+        block_size: usize,
+    ) -> Result<Option<BGZFRawBlock>, BGZFError> {
+        if block_size < header_size + 8 {
+            return Err(BGZFError::Other {
+                message: "Invalid block size",
+            });
+        }
+        data.resize(block_size, 0);
+        self.reader.read_exact(&mut data[header_size..])?;
+        let block = BGZFRawBlock {
+            position: self.position,
+            data,
+        };
+        self.position = block.next_position();
+        Ok(Some(block))
+    }
+
+    fn read_bytes(&mut self, data: &mut Vec<u8>, length: usize) -> io::Result<()> {
+        let start = data.len();
+        data.resize(start + length, 0);
+        self.reader.read_exact(&mut data[start..])
+    }
+}
+
+impl<R: BufRead> Iterator for BGZFBlocks<R> {
+    type Item = Result<BGZFRawBlock, BGZFError>;
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.finished {
+            return None;
+        }
+        let result = self.next_block().transpose();
+        if !matches!(result, Some(Ok(_))) {
+            self.finished = true;
+        }
+        result
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_blocks() -> Result<(), BGZFError> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let gzi = gzi::GZI::from_reader(&mut std::fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.gzi",
+        )?)?;
+        let blocks: Vec<BGZFRawBlock> = BGZFBlocks::new(&data[..]).collect::<Result<_, _>>()?;
+        assert_eq!(blocks.len(), gzi.entries.len() + 2);
+        for (one, entry) in blocks[1..].iter().zip(gzi.entries.iter()) {
+            assert_eq!(one.position, entry.compressed_offset);
+        }
+        assert!(blocks.last().unwrap().is_empty());
+        assert_eq!(blocks.last().unwrap().next_position(), data.len() as u64);
+        let concatenated: Vec<u8> = blocks.iter().flat_map(|x| x.data.clone()).collect();
+        assert_eq!(concatenated, data);
+
+        let mut truncated = BGZFBlocks::new(&data[..1000]);
+        assert!(truncated.next().unwrap().is_err());
+        assert!(truncated.next().is_none());
+        Ok(())
+    }
+}
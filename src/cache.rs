@@ -0,0 +1,564 @@
+use crate::stats::CacheStats;
+use crate::BGZFError;
+use std::collections::HashMap;
+use std::hash::Hash;
+use std::io;
+use std::ops::Deref;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+const NIL: usize = usize::MAX;
+
+struct Entry<K, V> {
+    key: K,
+    value: Option<V>,
+    prev: usize,
+    next: usize,
+}
+
+/// A least recently used cache with constant time lookup, insertion and eviction.
+///
+/// Entries are stored in a slab and linked in recently used order by index.
+pub(crate) struct LruCache<K, V> {
+    map: HashMap<K, usize>,
+    entries: Vec<Entry<K, V>>,
+    free: Vec<usize>,
+    head: usize,
+    tail: usize,
+}
+
+impl<K: Copy + Eq + Hash, V> LruCache<K, V> {
+    pub fn new() -> Self {
+        LruCache {
+            map: HashMap::new(),
+            entries: Vec::new(),
+            free: Vec::new(),
+            head: NIL,
+            tail: NIL,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.map.len()
+    }
+
+    #[cfg(test)]
+    pub fn contains(&self, key: K) -> bool {
+        self.map.contains_key(&key)
+    }
+
+    /// Insert a value as most recently used. An old value with the same key is returned.
+    pub fn insert(&mut self, key: K, value: V) -> Option<V> {
+        let old = self.remove(key);
+        let entry = Entry {
+            key,
+            value: Some(value),
+            prev: NIL,
+            next: NIL,
+        };
+        let index = if let Some(index) = self.free.pop() {
+            self.entries[index] = entry;
+            index
+        } else {
+            self.entries.push(entry);
+            self.entries.len() - 1
+        };
+        self.push_front(index);
+        self.map.insert(key, index);
+        old
+    }
+
+    pub fn remove(&mut self, key: K) -> Option<V> {
+        let index = self.map.remove(&key)?;
+        Some(self.release(index))
+    }
+
+    /// Get a value and mark it as most recently used.
+    pub fn get(&mut self, key: K) -> Option<&V> {
+        let index = *self.map.get(&key)?;
+        self.unlink(index);
+        self.push_front(index);
+        self.entries[index].value.as_ref()
+    }
+
+    /// Remove the least recently used value.
+    pub fn pop_lru(&mut self) -> Option<(K, V)> {
+        if self.tail == NIL {
+            return None;
+        }
+        let index = self.tail;
+        let key = self.entries[index].key;
+        self.map.remove(&key);
+        Some((key, self.release(index)))
+    }
+
+    fn release(&mut self, index: usize) -> V {
+        self.unlink(index);
+        self.free.push(index);
+        self.entries[index].value.take().unwrap()
+    }
+
+    fn unlink(&mut self, index: usize) {
+        let (prev, next) = (self.entries[index].prev, self.entries[index].next);
+        if prev == NIL {
+            self.head = next;
+        } else {
+            self.entries[prev].next = next;
+        }
+        if next == NIL {
+            self.tail = prev;
+        } else {
+            self.entries[next].prev = prev;
+        }
+        self.entries[index].prev = NIL;
+        self.entries[index].next = NIL;
+    }
+
+    fn push_front(&mut self, index: usize) {
+        self.entries[index].next = self.head;
+        if self.head != NIL {
+            self.entries[self.head].prev = index;
+        }
+        self.head = index;
+        if self.tail == NIL {
+            self.tail = index;
+        }
+    }
+}
+
+/// Inflated data of a block, owned by a reader or shared by readers through [`SharedBlockCache`].
+pub(crate) enum BlockData {
+    Owned(Vec<u8>),
+    Shared(Arc<Vec<u8>>),
+}
+
+impl Deref for BlockData {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match self {
+            BlockData::Owned(x) => x,
+            BlockData::Shared(x) => x,
+        }
+    }
+}
+
+/// An inflated block
+pub(crate) struct BGZFCache {
+    pub position: u64,
+    pub next_position: u64,
+    pub buffer: BlockData,
+}
+
+impl BGZFCache {
+    pub fn next_block_position(&self) -> u64 {
+        self.next_position
+    }
+}
+
+const DEFAULT_CACHE_LIMIT: usize = 10;
+const BUFFER_POOL_LIMIT: usize = 32;
+pub(crate) const MAX_BLOCK_SIZE: usize = 65536;
+
+/// Inflated blocks and read position of a reader.
+///
+/// The current block is held directly and other blocks are kept in a LRU cache.
+/// Buffers of evicted blocks are kept in a pool and reused to load new blocks.
+/// Readers pass a function to load a block at the given file offset, which returns `None` at end of file.
+pub(crate) struct BlockCache {
+    current: Option<BGZFCache>,
+    current_block: u64,
+    current_position_in_block: usize,
+    lru: LruCache<u64, BGZFCache>,
+    limit: usize,
+    byte_limit: usize,
+    cached_bytes: usize,
+    buffer_pool: Vec<Vec<u8>>,
+    stats: CacheStats,
+}
+
+impl BlockCache {
+    pub fn new() -> Self {
+        BlockCache {
+            current: None,
+            current_block: 0,
+            current_position_in_block: 0,
+            lru: LruCache::new(),
+            limit: DEFAULT_CACHE_LIMIT,
+            byte_limit: usize::MAX,
+            cached_bytes: 0,
+            buffer_pool: Vec::new(),
+            stats: CacheStats::default(),
+        }
+    }
+
+    /// BGZF virtual file offset of read position
+    pub fn position(&self) -> u64 {
+        self.current_block << 16 | (self.current_position_in_block & 0xffff) as u64
+    }
+
+    pub fn seek<F>(&mut self, position: u64, load: F) -> Result<(), BGZFError>
+    where
+        F: FnMut(&mut BlockCache, u64) -> Result<Option<BGZFCache>, BGZFError>,
+    {
+        self.stats.seeks += 1;
+        self.current_block = position >> 16;
+        self.current_position_in_block = (position & 0xffff) as usize;
+        self.switch_block(self.current_block, load)?;
+        Ok(())
+    }
+
+    pub fn fill_buf<F>(&mut self, mut load: F) -> io::Result<&[u8]>
+    where
+        F: FnMut(&mut BlockCache, u64) -> Result<Option<BGZFCache>, BGZFError>,
+    {
+        loop {
+            if !self
+                .switch_block(self.current_block, &mut load)
+                .map_err(|x| io::Error::new(io::ErrorKind::Other, format!("{}", x)))?
+            {
+                return Ok(&[]);
+            }
+            let block = self.current.as_ref().unwrap();
+            if self.current_position_in_block < block.buffer.len() {
+                break;
+            }
+            // Skip empty blocks such as end-of-file marker of concatenated files
+            self.current_block = block.next_block_position();
+            self.current_position_in_block = 0;
+        }
+
+        let block = self.current.as_ref().unwrap();
+        Ok(&block.buffer[self.current_position_in_block..])
+    }
+
+    pub fn consume(&mut self, amt: usize) {
+        if amt == 0 {
+            return;
+        }
+        let block = self.current.as_ref().unwrap();
+        let remain_bytes = block.buffer.len() - self.current_position_in_block;
+        if block.position == self.current_block && amt <= remain_bytes {
+            self.current_position_in_block += amt;
+            if self.current_position_in_block == block.buffer.len() {
+                self.current_block = block.next_block_position();
+                self.current_position_in_block = 0;
+            }
+        } else {
+            unreachable!()
+        }
+    }
+
+    pub fn read<F>(&mut self, buf: &mut [u8], mut load: F) -> io::Result<usize>
+    where
+        F: FnMut(&mut BlockCache, u64) -> Result<Option<BGZFCache>, BGZFError>,
+    {
+        let mut read_size = 0;
+        while read_size < buf.len() {
+            let available = self.fill_buf(&mut load)?;
+            if available.is_empty() {
+                break;
+            }
+            let load_size = available.len().min(buf.len() - read_size);
+            buf[read_size..(read_size + load_size)].copy_from_slice(&available[..load_size]);
+            self.consume(load_size);
+            read_size += load_size;
+        }
+        Ok(read_size)
+    }
+
+    /// Make the block at `block_position` current block.
+    /// Returns `false` if `block_position` is end of file.
+    fn switch_block<F>(&mut self, block_position: u64, mut load: F) -> Result<bool, BGZFError>
+    where
+        F: FnMut(&mut BlockCache, u64) -> Result<Option<BGZFCache>, BGZFError>,
+    {
+        if self.current.as_ref().map(|x| x.position) == Some(block_position) {
+            return Ok(true);
+        }
+        if self.activate(block_position) {
+            self.stats.hits += 1;
+            return Ok(true);
+        }
+        if let Some(block) = load(self, block_position)? {
+            self.stats.misses += 1;
+            self.set_current(block);
+            Ok(true)
+        } else {
+            Ok(false)
+        }
+    }
+
+    #[cfg(test)]
+    pub fn current(&self) -> Option<&BGZFCache> {
+        self.current.as_ref()
+    }
+
+    /// Number of cached blocks except the current block
+    #[cfg(test)]
+    pub fn len(&self) -> usize {
+        self.lru.len()
+    }
+
+    #[cfg(test)]
+    pub fn contains(&self, position: u64) -> bool {
+        self.lru.contains(position)
+    }
+
+    /// Total size of inflated blocks including the current block
+    pub fn cached_bytes(&self) -> usize {
+        self.cached_bytes + self.current.as_ref().map(|x| x.buffer.len()).unwrap_or(0)
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        self.stats
+    }
+
+    pub fn set_limit(&mut self, blocks: usize) {
+        self.limit = blocks.max(1);
+        self.evict();
+    }
+
+    pub fn set_byte_limit(&mut self, bytes: usize) {
+        self.byte_limit = bytes;
+        self.evict();
+    }
+
+    /// Make the cached block at `position` current block. Returns `false` if the block is not cached.
+    fn activate(&mut self, position: u64) -> bool {
+        if self.current.as_ref().map(|x| x.position) == Some(position) {
+            return true;
+        }
+        if let Some(block) = self.lru.remove(position) {
+            self.cached_bytes -= block.buffer.len();
+            self.set_current(block);
+            true
+        } else {
+            false
+        }
+    }
+
+    /// Make newly loaded `block` current block. The previous current block is moved into the LRU cache.
+    fn set_current(&mut self, block: BGZFCache) {
+        if let Some(previous) = self.current.replace(block) {
+            self.cached_bytes += previous.buffer.len();
+            if let Some(old) = self.lru.insert(previous.position, previous) {
+                self.stats.evictions += 1;
+                self.cached_bytes -= old.buffer.len();
+                self.recycle_block(old);
+            }
+        }
+        self.evict();
+    }
+
+    fn evict(&mut self) {
+        while self.lru.len() + 1 > self.limit || self.cached_bytes() > self.byte_limit {
+            if let Some((_, block)) = self.lru.pop_lru() {
+                self.stats.evictions += 1;
+                self.cached_bytes -= block.buffer.len();
+                self.recycle_block(block);
+            } else {
+                break;
+            }
+        }
+    }
+
+    pub fn take_buffer(&mut self) -> Vec<u8> {
+        self.buffer_pool
+            .pop()
+            .unwrap_or_else(|| Vec::with_capacity(MAX_BLOCK_SIZE))
+    }
+
+    pub fn recycle_buffer(&mut self, mut buffer: Vec<u8>) {
+        if self.buffer_pool.len() < BUFFER_POOL_LIMIT {
+            buffer.clear();
+            self.buffer_pool.push(buffer);
+        }
+    }
+
+    /// Reuse buffer of a block if the block is not shared.
+    pub fn recycle_block(&mut self, block: BGZFCache) {
+        if let BlockData::Owned(buffer) = block.buffer {
+            self.recycle_buffer(buffer);
+        }
+    }
+}
+
+const SHARED_CACHE_SHARDS: usize = 16;
+
+struct SharedBlock {
+    next_position: u64,
+    data: Arc<Vec<u8>>,
+}
+
+struct SharedShard {
+    lru: LruCache<(u64, u64), SharedBlock>,
+    cached_bytes: usize,
+}
+
+struct SharedCacheInner {
+    shards: Vec<Mutex<SharedShard>>,
+    shard_byte_limit: usize,
+    next_file_id: AtomicU64,
+}
+
+/// A thread-safe cache of inflated blocks shared by readers.
+///
+/// Blocks are keyed by a file ID and block offset, so readers of the same file in different threads
+/// inflate each block once while the block is cached. Blocks are distributed to independently locked
+/// shards to avoid lock contention. Cloning this struct creates a new handle of the same cache.
+/// ```
+/// use bgzip::{BGZFReader, SharedBlockCache};
+/// use std::io::BufRead;
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let cache = SharedBlockCache::new(64 << 20);
+/// let file_id = cache.new_file_id();
+/// let handles: Vec<_> = (0..4)
+///     .map(|_| {
+///         let cache = cache.clone();
+///         std::thread::spawn(move || -> Result<usize, bgzip::BGZFError> {
+///             let mut reader = BGZFReader::new(std::fs::File::open(
+///                 "testfiles/common_all_20180418_half.vcf.gz",
+///             )?);
+///             reader.set_shared_cache(cache, file_id);
+///             Ok(reader.lines().count())
+///         })
+///     })
+///     .collect();
+/// for one in handles {
+///     assert_eq!(one.join().unwrap()?, 66171);
+/// }
+/// # Ok(())
+/// # }
+/// ```
+#[derive(Clone)]
+pub struct SharedBlockCache {
+    inner: Arc<SharedCacheInner>,
+}
+
+impl SharedBlockCache {
+    /// Create a cache which keeps inflated blocks up to `byte_limit` bytes in total.
+    pub fn new(byte_limit: usize) -> Self {
+        SharedBlockCache {
+            inner: Arc::new(SharedCacheInner {
+                shards: (0..SHARED_CACHE_SHARDS)
+                    .map(|_| {
+                        Mutex::new(SharedShard {
+                            lru: LruCache::new(),
+                            cached_bytes: 0,
+                        })
+                    })
+                    .collect(),
+                shard_byte_limit: byte_limit / SHARED_CACHE_SHARDS,
+                next_file_id: AtomicU64::new(0),
+            }),
+        }
+    }
+
+    /// Allocate a new file ID. Readers of the same file should use the same ID, and readers of different files must use different IDs.
+    pub fn new_file_id(&self) -> u64 {
+        self.inner.next_file_id.fetch_add(1, Ordering::Relaxed)
+    }
+
+    /// Total size of cached blocks
+    pub fn cached_bytes(&self) -> usize {
+        self.inner
+            .shards
+            .iter()
+            .map(|x| x.lock().unwrap().cached_bytes)
+            .sum()
+    }
+
+    fn shard(&self, file_id: u64, position: u64) -> &Mutex<SharedShard> {
+        let hash = (position ^ file_id.rotate_left(32)).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        &self.inner.shards[(hash >> 32) as usize % SHARED_CACHE_SHARDS]
+    }
+
+    /// Get a block from the cache, or load it with `load` and insert it into the cache.
+    ///
+    /// Another thread may load the same block at the same time if it is not cached yet.
+    pub(crate) fn load<F>(
+        &self,
+        file_id: u64,
+        cache: &mut BlockCache,
+        position: u64,
+        load: F,
+    ) -> Result<Option<BGZFCache>, BGZFError>
+    where
+        F: FnOnce(&mut BlockCache, u64) -> Result<Option<BGZFCache>, BGZFError>,
+    {
+        let shard = self.shard(file_id, position);
+        if let Some(block) = shard.lock().unwrap().lru.get((file_id, position)) {
+            return Ok(Some(BGZFCache {
+                position,
+                next_position: block.next_position,
+                buffer: BlockData::Shared(block.data.clone()),
+            }));
+        }
+
+        let block = if let Some(block) = load(cache, position)? {
+            block
+        } else {
+            return Ok(None);
+        };
+        let data = match block.buffer {
+            BlockData::Owned(x) => Arc::new(x),
+            BlockData::Shared(x) => x,
+        };
+        let mut locked = shard.lock().unwrap();
+        locked.cached_bytes += data.len();
+        if let Some(old) = locked.lru.insert(
+            (file_id, position),
+            SharedBlock {
+                next_position: block.next_position,
+                data: data.clone(),
+            },
+        ) {
+            locked.cached_bytes -= old.data.len();
+        }
+        while locked.cached_bytes > self.inner.shard_byte_limit {
+            if let Some((_, old)) = locked.lru.pop_lru() {
+                locked.cached_bytes -= old.data.len();
+            } else {
+                break;
+            }
+        }
+        Ok(Some(BGZFCache {
+            position,
+            next_position: block.next_position,
+            buffer: BlockData::Shared(data),
+        }))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_lru() {
+        let mut cache = LruCache::new();
+        for i in 0..5 {
+            assert_eq!(cache.insert(i, i * 10), None);
+        }
+        assert_eq!(cache.len(), 5);
+        assert_eq!(cache.pop_lru(), Some((0, 0)));
+        assert_eq!(cache.pop_lru(), Some((1, 10)));
+        assert_eq!(cache.pop_lru(), Some((2, 20)));
+        assert_eq!(cache.remove(4), Some(40));
+        assert_eq!(cache.insert(5, 50), None);
+        assert_eq!(cache.insert(3, 31), Some(30));
+        assert!(cache.contains(3));
+        assert_eq!(cache.pop_lru(), Some((5, 50)));
+        assert_eq!(cache.pop_lru(), Some((3, 31)));
+        assert_eq!(cache.pop_lru(), None);
+        assert!(!cache.contains(3));
+        assert_eq!(cache.len(), 0);
+
+        for i in 0..3 {
+            cache.insert(i, i);
+        }
+        assert_eq!(cache.get(0), Some(&0));
+        assert_eq!(cache.get(10), None);
+        assert_eq!(cache.pop_lru(), Some((1, 1)));
+    }
+}
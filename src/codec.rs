@@ -0,0 +1,144 @@
+use std::io;
+
+/// Deflate implementation used to compress and inflate BGZF blocks.
+///
+/// Each BGZF block is a complete raw deflate stream of at most 64KiB, so a codec handles a whole block
+/// with one call instead of streaming. [`Flate2Codec`] is used by default.
+///
+/// Only [`Flate2Codec`] is provided by this crate; there is no built-in libdeflate or zlib-ng codec.
+/// This trait is the extension point for such backends: implement it with another library, such as libdeflate,
+/// and pass it to constructors like [`BGZFWriter::with_codec`](crate::BGZFWriter::with_codec)
+/// and [`BGZFReader::with_codec`](crate::BGZFReader::with_codec).
+/// The backend of [`Flate2Codec`] itself, such as zlib-ng, can be selected with features of `flate2`.
+pub trait DeflateCodec: Send + Sync {
+    /// Create a deflater. One deflater is created for each thread.
+    fn deflater(&self, level: flate2::Compression) -> Box<dyn BlockDeflater>;
+    /// Create an inflater. One inflater is created for each thread.
+    fn inflater(&self) -> Box<dyn BlockInflater>;
+}
+
+/// Compressor of whole BGZF blocks
+pub trait BlockDeflater: Send {
+    /// Compress `data` into a raw deflate stream and append it to `output`.
+    ///
+    /// Returns `false` if the stream is longer than `limit` bytes. `output` may contain a part of the stream in that case.
+    fn deflate(&mut self, data: &[u8], output: &mut Vec<u8>, limit: usize) -> io::Result<bool>;
+}
+
+/// Decompressor of whole BGZF blocks
+pub trait BlockInflater: Send {
+    /// Inflate a raw deflate stream `compressed` and append the data to `output`.
+    ///
+    /// `uncompressed_size` is the size stored in the block footer. A stream of another size is an error.
+    fn inflate(
+        &mut self,
+        compressed: &[u8],
+        output: &mut Vec<u8>,
+        uncompressed_size: usize,
+    ) -> io::Result<()>;
+}
+
+/// Codec based on `flate2`. The deflate backend is selected with features of `flate2`.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Flate2Codec;
+
+impl DeflateCodec for Flate2Codec {
+    fn deflater(&self, level: flate2::Compression) -> Box<dyn BlockDeflater> {
+        Box::new(Flate2Deflater {
+            compress: flate2::Compress::new(level, false),
+        })
+    }
+
+    fn inflater(&self) -> Box<dyn BlockInflater> {
+        Box::new(Flate2Inflater {
+            decompress: flate2::Decompress::new(false),
+        })
+    }
+}
+
+struct Flate2Deflater {
+    compress: flate2::Compress,
+}
+
+impl BlockDeflater for Flate2Deflater {
+    fn deflate(&mut self, data: &[u8], output: &mut Vec<u8>, limit: usize) -> io::Result<bool> {
+        let start = output.len();
+        output.reserve(data.len() + data.len() / 16 + 64);
+        self.compress.reset();
+        loop {
+            let consumed = self.compress.total_in() as usize;
+            let status = self
+                .compress
+                .compress_vec(&data[consumed..], output, flate2::FlushCompress::Finish)
+                .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+            if output.len() - start > limit {
+                return Ok(false);
+            }
+            if status == flate2::Status::StreamEnd {
+                return Ok(true);
+            }
+            output.reserve(1024);
+        }
+    }
+}
+
+struct Flate2Inflater {
+    decompress: flate2::Decompress,
+}
+
+impl BlockInflater for Flate2Inflater {
+    fn inflate(
+        &mut self,
+        compressed: &[u8],
+        output: &mut Vec<u8>,
+        uncompressed_size: usize,
+    ) -> io::Result<()> {
+        output.reserve(uncompressed_size);
+        self.decompress.reset(false);
+        let status = self
+            .decompress
+            .decompress_vec(compressed, output, flate2::FlushDecompress::Finish)
+            .map_err(|x| io::Error::new(io::ErrorKind::InvalidData, x))?;
+        // decompress_vec never grows `output`, so a longer stream does not reach the end
+        if status != flate2::Status::StreamEnd
+            || self.decompress.total_out() != uncompressed_size as u64
+        {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "Unmatched length",
+            ));
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_flate2_codec() -> io::Result<()> {
+        let data: Vec<u8> = (0..60000u32).map(|x| (x % 251) as u8).collect();
+        let codec = Flate2Codec;
+        let mut deflater = codec.deflater(flate2::Compression::default());
+        let mut compressed = vec![1, 2, 3];
+        assert!(deflater.deflate(&data, &mut compressed, 65000)?);
+        assert_eq!(&compressed[..3], &[1, 2, 3]);
+        assert!(!deflater.deflate(&data, &mut Vec::new(), 10)?);
+
+        let mut inflater = codec.inflater();
+        let mut inflated = Vec::new();
+        inflater.inflate(&compressed[3..], &mut inflated, data.len())?;
+        assert_eq!(inflated, data);
+        assert!(inflater
+            .inflate(&compressed[3..], &mut Vec::new(), data.len() - 1)
+            .is_err());
+        assert!(inflater
+            .inflate(&compressed[3..], &mut Vec::new(), data.len() + 1)
+            .is_err());
+        assert!(inflater
+            .inflate(&compressed[3..100], &mut Vec::new(), data.len())
+            .is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,153 @@
+use crate::*;
+use std::convert::TryInto;
+use std::io::{self, Read, Result, Write};
+
+/// Start position of a BGZF block in compressed file and in uncompressed data
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct GZIEntry {
+    pub compressed_offset: u64,
+    pub uncompressed_offset: u64,
+}
+
+/// GZI index, a table of compressed and uncompressed offsets of BGZF blocks created by `bgzip -i`.
+///
+/// The first block at offset 0 is not stored in the table.
+#[derive(Debug, Clone, PartialEq, Default)]
+pub struct GZI {
+    pub entries: Vec<GZIEntry>,
+}
+
+impl GZI {
+    pub fn new() -> Self {
+        GZI::default()
+    }
+
+    pub fn from_reader(reader: &mut impl Read) -> Result<Self> {
+        let mut reader = io::BufReader::new(reader);
+        let number_of_entries = reader.read_le_u64()?;
+        let mut entries = Vec::with_capacity(number_of_entries.min(1 << 20) as usize);
+        for _ in 0..number_of_entries {
+            let compressed_offset = reader.read_le_u64()?;
+            let uncompressed_offset = reader.read_le_u64()?;
+            entries.push(GZIEntry {
+                compressed_offset,
+                uncompressed_offset,
+            });
+        }
+        if entries
+            .windows(2)
+            .any(|x| x[0].uncompressed_offset > x[1].uncompressed_offset)
+        {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "GZI entries are not sorted",
+            ));
+        }
+        Ok(GZI { entries })
+    }
+
+    pub fn write<W: Write>(&self, mut writer: W) -> Result<()> {
+        let mut data = Vec::with_capacity(8 + self.entries.len() * 16);
+        data.extend_from_slice(&(self.entries.len() as u64).to_le_bytes());
+        for one in &self.entries {
+            data.extend_from_slice(&one.compressed_offset.to_le_bytes());
+            data.extend_from_slice(&one.uncompressed_offset.to_le_bytes());
+        }
+        writer.write_all(&data)
+    }
+
+    /// Find the last block starting at or before `uncompressed_offset`.
+    pub fn find_block(&self, uncompressed_offset: u64) -> GZIEntry {
+        let index = self
+            .entries
+            .partition_point(|x| x.uncompressed_offset <= uncompressed_offset);
+        if index == 0 {
+            GZIEntry {
+                compressed_offset: 0,
+                uncompressed_offset: 0,
+            }
+        } else {
+            self.entries[index - 1]
+        }
+    }
+
+    /// Add a block. Blocks must be added in order, and the first block at offset 0 is ignored.
+    pub(crate) fn add_block(&mut self, compressed_offset: u64, uncompressed_offset: u64) {
+        if uncompressed_offset > 0 {
+            self.entries.push(GZIEntry {
+                compressed_offset,
+                uncompressed_offset,
+            });
+        }
+    }
+}
+
+/// Seek `reader` to `uncompressed_offset` with the start of a block found in `gzi`.
+/// Seeking beyond end of data moves to end of data.
+pub(crate) fn seek_uncompressed<R: BGZFRead>(
+    reader: &mut R,
+    gzi: &GZI,
+    uncompressed_offset: u64,
+) -> std::result::Result<(), BGZFError> {
+    let block = gzi.find_block(uncompressed_offset);
+    reader.bgzf_seek(block.compressed_offset << 16)?;
+    let mut remain = uncompressed_offset - block.uncompressed_offset;
+    while remain > 0 {
+        let available = reader.fill_buf()?.len();
+        if available == 0 {
+            break;
+        }
+        let skip = available.min(remain.try_into().unwrap_or(usize::MAX));
+        reader.consume(skip);
+        remain -= skip as u64;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs::File;
+
+    #[test]
+    fn test_gzi() -> Result<()> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz.gzi")?;
+        let gzi = GZI::from_reader(&mut &data[..])?;
+        assert_eq!(gzi.entries.len(), 263);
+        assert_eq!(
+            gzi.entries[0],
+            GZIEntry {
+                compressed_offset: 14164,
+                uncompressed_offset: 65280
+            }
+        );
+        assert_eq!(gzi.find_block(65279).compressed_offset, 0);
+        assert_eq!(gzi.find_block(65280).compressed_offset, 14164);
+        assert_eq!(gzi.find_block(130559).compressed_offset, 14164);
+        assert_eq!(gzi.find_block(u64::MAX), *gzi.entries.last().unwrap());
+
+        let mut written = Vec::new();
+        gzi.write(&mut written)?;
+        assert_eq!(written, data);
+
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut expected)?;
+        let mut reader = BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        reader.set_gzi(gzi);
+        let mut buffer = [0; 100];
+        for offset in [0, 65280, 1_000_000, 65279, 17_168_640 + 1000].iter() {
+            reader
+                .seek_uncompressed(*offset)
+                .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+            reader.read_exact(&mut buffer)?;
+            let offset = *offset as usize;
+            assert_eq!(&buffer[..], &expected[offset..(offset + 100)]);
+        }
+        reader
+            .seek_uncompressed(expected.len() as u64 + 10)
+            .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+        assert_eq!(reader.read(&mut buffer)?, 0);
+        Ok(())
+    }
+}
@@ -58,6 +58,24 @@ pub const FILESYSTEM_UNIX: u8 = 3;
 pub const FILESYSTEM_NTFS: u8 = 11;
 pub const FILESYSTEM_UNKNOWN: u8 = 255;
 
+/// Size of the header written by bgzip, which has only a `BC` extra subfield
+pub const BGZF_HEADER_SIZE: usize = 18;
+
+/// Get block size (BSIZE + 1) from the header at the beginning of `data` without allocation.
+///
+/// Returns `None` if `data` is shorter than [`BGZF_HEADER_SIZE`] or the header is not the layout written by bgzip.
+/// Parse such headers with [`BGZFHeader::from_reader`].
+pub(crate) fn fixed_header_block_size(data: &[u8]) -> Option<usize> {
+    match data.get(..BGZF_HEADER_SIZE)? {
+        [31, 139, DEFLATE, flags, _, _, _, _, _, _, 6, 0, 66, 67, 2, 0, size1, size2]
+            if flags & !FLAG_FTEXT == FLAG_FEXTRA =>
+        {
+            Some(usize::from(u16::from_le_bytes([*size1, *size2])) + 1)
+        }
+        _ => None,
+    }
+}
+
 impl BGZFHeader {
     pub fn new(fast: bool, modified_time: u32, compressed_len: u16) -> Self {
         let block_size = compressed_len + 20 + 6;
@@ -91,7 +109,7 @@ impl BGZFHeader {
 
     pub fn header_size(&self) -> u64 {
         10u64
-            + self.extra_field_len.map(|x| x.into()).unwrap_or(0)
+            + self.extra_field_len.map(|x| 2 + u64::from(x)).unwrap_or(0)
             + self
                 .file_name
                 .as_ref()
@@ -235,6 +253,33 @@ mod test {
         assert_eq!(header.extra_field_len, Some(6));
         assert_eq!(header.extra_field[0].data.len(), 2);
         assert_eq!(header.extra_field[0].field_length, 2);
+        assert_eq!(header.header_size(), 18);
+        Ok(())
+    }
+
+    #[test]
+    fn test_fixed_header_block_size() -> Result<(), BGZFError> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let header = BGZFHeader::from_reader(&mut &data[..])?;
+        assert_eq!(
+            fixed_header_block_size(&data),
+            Some(header.block_size()? as usize + 1)
+        );
+        assert_eq!(fixed_header_block_size(&data[..17]), None);
+
+        let mut header = BGZFHeader::new(false, 0, 100);
+        let mut bytes = Vec::new();
+        header.write(&mut bytes)?;
+        assert_eq!(fixed_header_block_size(&bytes), Some(126));
+        // Other layouts are left to the general parser
+        header.extra_field.push(ExtraField::new(1, 2, vec![3]));
+        header.extra_field_len = Some(11);
+        bytes.clear();
+        header.write(&mut bytes)?;
+        assert_eq!(fixed_header_block_size(&bytes), None);
+        assert_eq!(BGZFHeader::from_reader(&mut &bytes[..])?.block_size()?, 125);
+        let gzip = std::fs::read("testfiles/common_all_20180418_half.vcf.nobgzip.gz")?;
+        assert_eq!(fixed_header_block_size(&gzip), None);
         Ok(())
     }
 
@@ -43,21 +43,99 @@
 //! }
 //! ```
 
+#[cfg(feature = "tokio")]
+mod async_io;
+mod blocks;
+mod cache;
+mod codec;
 mod error;
+/// GZI index of uncompressed offsets
+pub mod gzi;
 
 /// BGZ header parser
 pub mod header;
+mod partition;
+mod positional;
+mod range;
 mod read;
+mod records;
+mod slice;
+mod stats;
+mod stream;
 /// Tabix file parser. (This module is alpha state.)
 pub mod tabix;
+mod worker;
 mod write;
 
+#[cfg(feature = "tokio")]
+pub use async_io::{AsyncBGZFReader, AsyncBGZFWriter};
+pub use blocks::{BGZFBlocks, BGZFRawBlock};
+pub use cache::SharedBlockCache;
+pub use codec::{BlockDeflater, BlockInflater, DeflateCodec, Flate2Codec};
 pub use error::BGZFError;
-pub use read::BGZFReader;
+pub use partition::partition;
+pub use positional::{BGZFPositionalReader, ReadAt};
+pub use range::{BGZFRangeReader, RangeSource};
+pub use read::{decompress_parallel, BGZFReader};
+pub use records::RecordReader;
+pub use slice::BGZFSliceReader;
+pub use stats::{ReaderStats, WriterStats};
+pub use stream::BGZFStreamReader;
 pub use write::BGZFWriter;
 
 use std::io;
 
+/// BGZF readers which support seek with virtual file offset.
+pub trait BGZFRead: io::BufRead {
+    /// Seek BGZF with virtual file offset described in [BGZF format](https://samtools.github.io/hts-specs/SAMv1.pdf).
+    fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError>;
+    /// Get BGZF virtual file offset described in [BGZF format](https://samtools.github.io/hts-specs/SAMv1.pdf).
+    fn bgzf_pos(&self) -> u64;
+    /// Hint that blocks of `chunks` will be read. Readers of remote files may fetch them in advance.
+    fn prefetch(&mut self, _chunks: &[tabix::TabixChunk]) -> Result<(), BGZFError> {
+        Ok(())
+    }
+}
+
+impl<R: io::Read + io::Seek> BGZFRead for BGZFReader<R> {
+    fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        BGZFReader::bgzf_seek(self, position)
+    }
+    fn bgzf_pos(&self) -> u64 {
+        BGZFReader::bgzf_pos(self)
+    }
+}
+
+impl<R: ReadAt> BGZFRead for BGZFPositionalReader<R> {
+    fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        BGZFPositionalReader::bgzf_seek(self, position)
+    }
+    fn bgzf_pos(&self) -> u64 {
+        BGZFPositionalReader::bgzf_pos(self)
+    }
+}
+
+impl<S: RangeSource> BGZFRead for BGZFRangeReader<S> {
+    fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        BGZFRangeReader::bgzf_seek(self, position)
+    }
+    fn bgzf_pos(&self) -> u64 {
+        BGZFRangeReader::bgzf_pos(self)
+    }
+    fn prefetch(&mut self, chunks: &[tabix::TabixChunk]) -> Result<(), BGZFError> {
+        BGZFRangeReader::prefetch(self, chunks)
+    }
+}
+
+impl<T: AsRef<[u8]>> BGZFRead for BGZFSliceReader<T> {
+    fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        BGZFSliceReader::bgzf_seek(self, position)
+    }
+    fn bgzf_pos(&self) -> u64 {
+        BGZFSliceReader::bgzf_pos(self)
+    }
+}
+
 pub(crate) trait BinaryReader: io::Read {
     fn read_le_u8(&mut self) -> io::Result<u8> {
         let mut buf: [u8; 1] = [0];
@@ -87,6 +165,7 @@ pub(crate) trait BinaryReader: io::Read {
 }
 
 impl<R: io::Read> BinaryReader for io::BufReader<R> {}
+impl BinaryReader for &[u8] {}
 
 #[cfg(test)]
 mod test {
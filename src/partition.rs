@@ -0,0 +1,196 @@
+use crate::cache::MAX_BLOCK_SIZE;
+use crate::slice::find_block;
+use crate::tabix::TabixChunk;
+use crate::*;
+use std::convert::TryInto;
+use std::io::{self, BufRead, Read, Seek, SeekFrom};
+
+/// Split BGZF compressed lines into `n` ranges of about the same compressed size.
+///
+/// Ranges are virtual file offsets. Range boundaries are found by scanning block headers near the
+/// split points and moved to the beginning of the next line, so each line belongs to exactly one range.
+/// Only a few blocks around each split point are read. Some ranges are empty if the file has fewer blocks than `n`.
+/// See [`Tabix::partition`](tabix::Tabix::partition) to split with a tabix index instead.
+///
+/// Read a range by seeking to `begin` and reading lines while [`BGZFReader::bgzf_pos`] is less than `end`.
+/// ```
+/// use bgzip::BGZFReader;
+/// use std::io::BufRead;
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let path = "testfiles/common_all_20180418_half.vcf.gz";
+/// let ranges = bgzip::partition(std::fs::File::open(path)?, 4)?;
+/// let mut lines = 0;
+/// for range in ranges {
+///     let mut reader = BGZFReader::new(std::fs::File::open(path)?);
+///     reader.bgzf_seek(range.begin)?;
+///     let mut line = Vec::new();
+///     while reader.bgzf_pos() < range.end && reader.read_until(b'\n', &mut line)? > 0 {
+///         lines += 1;
+///     }
+/// }
+/// assert_eq!(lines, 66171);
+/// # Ok(())
+/// # }
+/// ```
+pub fn partition<R: Read + Seek>(mut reader: R, n: usize) -> Result<Vec<TabixChunk>, BGZFError> {
+    let file_size = reader.seek(SeekFrom::End(0))?;
+    let n = n.max(1);
+    let mut boundaries = Vec::with_capacity(n - 1);
+    for i in 1..n {
+        let target = (file_size as u128 * i as u128 / n as u128) as u64;
+        boundaries.push(find_boundary(&mut reader, file_size, target)?);
+    }
+
+    let mut reader = BGZFReader::new(reader);
+    let end = file_size << 16;
+    let mut begins = vec![0];
+    let mut line = Vec::new();
+    for one in boundaries {
+        let begin = match one {
+            Some((previous, uncompressed_size)) => {
+                // Start at the line after the last byte of the previous block
+                reader.bgzf_seek(previous << 16 | (uncompressed_size - 1) as u64)?;
+                line.clear();
+                reader.read_until(b'\n', &mut line)?;
+                reader.bgzf_pos()
+            }
+            None => end,
+        };
+        begins.push(begin.max(*begins.last().unwrap()));
+    }
+
+    let mut ranges: Vec<TabixChunk> = begins
+        .windows(2)
+        .map(|x| TabixChunk {
+            begin: x[0],
+            end: x[1],
+        })
+        .collect();
+    ranges.push(TabixChunk {
+        begin: *begins.last().unwrap(),
+        end,
+    });
+    Ok(ranges)
+}
+
+/// Find the last non-empty block before the first block starting at or after `target`.
+/// Returns the offset and uncompressed size of the block, or `None` if no block starts after `target`.
+fn find_boundary<R: Read + Seek>(
+    reader: &mut R,
+    file_size: u64,
+    target: u64,
+) -> Result<Option<(u64, usize)>, BGZFError> {
+    // A block starts within the first MAX_BLOCK_SIZE bytes, and it is before `target`
+    let window_start = target.saturating_sub(2 * MAX_BLOCK_SIZE as u64);
+    reader.seek(SeekFrom::Start(window_start))?;
+    let mut data = Vec::new();
+    reader
+        .take(4 * MAX_BLOCK_SIZE as u64)
+        .read_to_end(&mut data)?;
+
+    let is_block_start = |offset: usize| -> bool {
+        match find_block(&data[offset..]) {
+            Ok(Some((_, block_size))) => {
+                let next = offset + block_size;
+                window_start + next as u64 == file_size || data[next..].starts_with(&[31, 139, 8])
+            }
+            _ => false,
+        }
+    };
+    let mut position = if window_start == 0 {
+        0
+    } else {
+        (0..MAX_BLOCK_SIZE.min(data.len()))
+            .find(|x| data[*x..].starts_with(&[31, 139, 8]) && is_block_start(*x))
+            .ok_or(BGZFError::NotBGZF)?
+    };
+
+    let mut previous = None;
+    while window_start + (position as u64) < target {
+        let (_, block_size) = find_block(&data[position..])?
+            .ok_or_else(|| io::Error::new(io::ErrorKind::UnexpectedEof, "Truncated block"))?;
+        let next = position + block_size;
+        let uncompressed_size =
+            u32::from_le_bytes(data[(next - 4)..next].try_into().unwrap()) as usize;
+        if uncompressed_size > 0 {
+            previous = Some((window_start + position as u64, uncompressed_size));
+        }
+        position = next;
+    }
+    if window_start + position as u64 >= file_size {
+        return Ok(None);
+    }
+    Ok(previous)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs;
+    use std::io::Write;
+
+    fn read_ranges(data: &[u8], ranges: &[TabixChunk]) -> Result<Vec<Vec<u8>>, BGZFError> {
+        let mut reader = crate::BGZFSliceReader::new(data);
+        let mut lines = Vec::new();
+        for range in ranges {
+            assert!(range.begin <= range.end);
+            reader.bgzf_seek(range.begin)?;
+            while reader.bgzf_pos() < range.end {
+                let mut line = Vec::new();
+                if reader.read_until(b'\n', &mut line)? == 0 {
+                    break;
+                }
+                lines.push(line);
+            }
+        }
+        Ok(lines)
+    }
+
+    #[test]
+    fn test_partition() -> Result<(), BGZFError> {
+        let compressed = fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&compressed[..]).read_to_end(&mut expected)?;
+        let expected_lines: Vec<Vec<u8>> = expected
+            .split_inclusive(|x| *x == b'\n')
+            .map(|x| x.to_vec())
+            .collect();
+
+        for n in [1, 2, 7, 64, 1000].iter() {
+            let ranges = partition(io::Cursor::new(&compressed), *n)?;
+            assert_eq!(ranges.len(), *n);
+            assert_eq!(ranges[0].begin, 0);
+            for one in ranges.windows(2) {
+                assert_eq!(one[0].end, one[1].begin);
+            }
+            assert_eq!(read_ranges(&compressed, &ranges)?, expected_lines);
+            if *n == 7 {
+                let sizes: Vec<u64> = ranges.iter().map(|x| (x.end - x.begin) >> 16).collect();
+                let average = compressed.len() as u64 / 7;
+                assert!(sizes
+                    .iter()
+                    .all(|x| *x > average - 70_000 && *x < average + 70_000));
+            }
+        }
+
+        // Lines longer than blocks and concatenated files
+        let mut data = Vec::new();
+        for i in 0..50 {
+            if i % 5 == 0 {
+                data.extend(std::iter::repeat(b'x').take(100_000));
+            }
+            writeln!(data, "line {}", i)?;
+        }
+        let mut compressed = Vec::new();
+        for _ in 0..2 {
+            let mut writer = BGZFWriter::new(&mut compressed, flate2::Compression::none());
+            writer.write_all(&data)?;
+            writer.close()?;
+        }
+        let ranges = partition(io::Cursor::new(&compressed), 9)?;
+        let lines = read_ranges(&compressed, &ranges)?;
+        assert_eq!(lines.concat(), [&data[..], &data[..]].concat());
+        assert_eq!(lines.len(), 100);
+        Ok(())
+    }
+}
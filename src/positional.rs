@@ -0,0 +1,299 @@
+use crate::cache::{BGZFCache, BlockCache, SharedBlockCache, MAX_BLOCK_SIZE};
+use crate::codec::DeflateCodec;
+use crate::read::BlockDecompressor;
+use crate::slice::find_block;
+use crate::*;
+use std::io::{self, BufRead, Read};
+use std::sync::Arc;
+
+/// Positional read without changing a file position, like `pread(2)`.
+///
+/// Implementations must be safe to call from multiple threads through a shared reference.
+pub trait ReadAt {
+    /// Read bytes at `offset` into `buf`. Returns the number of bytes read, and 0 at end of file.
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize>;
+}
+
+#[cfg(unix)]
+impl ReadAt for std::fs::File {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        std::os::unix::fs::FileExt::read_at(self, buf, offset)
+    }
+}
+
+#[cfg(windows)]
+impl ReadAt for std::fs::File {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        std::os::windows::fs::FileExt::seek_read(self, buf, offset)
+    }
+}
+
+impl ReadAt for [u8] {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        if offset >= self.len() as u64 {
+            return Ok(0);
+        }
+        let data = &self[(offset as usize)..];
+        let length = data.len().min(buf.len());
+        buf[..length].copy_from_slice(&data[..length]);
+        Ok(length)
+    }
+}
+
+impl ReadAt for Vec<u8> {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        self[..].read_at(buf, offset)
+    }
+}
+
+impl<T: ReadAt + ?Sized> ReadAt for &T {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        (**self).read_at(buf, offset)
+    }
+}
+
+impl<T: ReadAt + ?Sized> ReadAt for Arc<T> {
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        (**self).read_at(buf, offset)
+    }
+}
+
+/// Fill `buf` as much as possible. Returns a shorter length only at end of file.
+fn read_full_at<R: ReadAt + ?Sized>(reader: &R, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        match reader.read_at(&mut buf[filled..], offset + filled as u64) {
+            Ok(0) => break,
+            Ok(n) => filled += n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => (),
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(filled)
+}
+
+/// Loads blocks with positional reads.
+struct ReadAtSource<R: ReadAt> {
+    reader: R,
+    decompressor: BlockDecompressor,
+    shared_cache: Option<(SharedBlockCache, u64)>,
+    raw: Vec<u8>,
+}
+
+impl<R: ReadAt> ReadAtSource<R> {
+    fn load_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some((shared_cache, file_id)) = self.shared_cache.clone() {
+            shared_cache.load(file_id, cache, block_position, |cache, position| {
+                self.inflate_block(cache, position)
+            })
+        } else {
+            self.inflate_block(cache, block_position)
+        }
+    }
+
+    /// Read a whole block with one positional read in most cases, and inflate it.
+    fn inflate_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        self.raw.resize(MAX_BLOCK_SIZE, 0);
+        let length = read_full_at(&self.reader, &mut self.raw, block_position)?;
+        if length == 0 {
+            return Ok(None);
+        }
+        let (header_size, block_size) =
+            find_block(&self.raw[..length])?.ok_or(BGZFError::Other {
+                message: "Invalid block size",
+            })?;
+        let buffer = cache.take_buffer();
+        Ok(Some(self.decompressor.decompress(
+            block_position,
+            block_position + block_size as u64,
+            &self.raw[header_size..block_size],
+            buffer,
+        )?))
+    }
+}
+
+/// A BGZF reader based on positional reads
+///
+/// Blocks are loaded with [`ReadAt::read_at`] instead of seek and read, so the underlying file is never modified.
+/// Use `Arc<File>` or `&File` to serve readers in many threads with one file handle.
+/// Cloning this reader is cheap. A clone shares the file and the shared cache, and has its own read position and cache.
+/// ```
+/// use bgzip::BGZFPositionalReader;
+/// use std::io::BufRead;
+/// use std::sync::Arc;
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let file = Arc::new(std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+/// let reader = BGZFPositionalReader::new(file);
+/// let handles: Vec<_> = (0..4)
+///     .map(|_| {
+///         let mut reader = reader.clone();
+///         std::thread::spawn(move || {
+///             reader.bgzf_seek(4210818610).unwrap();
+///             let mut line = String::new();
+///             reader.read_line(&mut line).unwrap();
+///             line
+///         })
+///     })
+///     .collect();
+/// for one in handles {
+///     assert!(one.join().unwrap().starts_with("1\t72700625\t"));
+/// }
+/// # Ok(())
+/// # }
+/// ```
+pub struct BGZFPositionalReader<R: ReadAt> {
+    source: ReadAtSource<R>,
+    cache: BlockCache,
+}
+
+impl<R: ReadAt> BGZFPositionalReader<R> {
+    /// Create a new BGZF reader from a positional reader such as `std::fs::File`
+    pub fn new(reader: R) -> Self {
+        BGZFPositionalReader {
+            source: ReadAtSource {
+                reader,
+                decompressor: BlockDecompressor::new(),
+                shared_cache: None,
+                raw: Vec::new(),
+            },
+            cache: BlockCache::new(),
+        }
+    }
+
+    /// Set maximum number of inflated blocks kept in the cache, including the current block.
+    ///
+    /// The least recently used block is evicted first. Default limit is 10 blocks.
+    pub fn set_cache_limit(&mut self, blocks: usize) {
+        self.cache.set_limit(blocks);
+    }
+
+    /// Set maximum total size of inflated blocks kept in the cache in bytes.
+    ///
+    /// The current block is always kept even if it exceeds the limit. No limit by default.
+    pub fn set_cache_byte_limit(&mut self, bytes: usize) {
+        self.cache.set_byte_limit(bytes);
+    }
+
+    /// Inflate blocks with `codec` instead of the default [`Flate2Codec`](crate::Flate2Codec).
+    pub fn set_codec(&mut self, codec: &dyn DeflateCodec) {
+        self.source.decompressor.set_codec(codec);
+    }
+
+    /// Enable or disable CRC32 verification. See [`BGZFReader::set_verify_crc`](crate::BGZFReader::set_verify_crc).
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.source.decompressor.set_verify_crc(verify);
+    }
+
+    /// Share inflated blocks with other readers. See [`BGZFReader::set_shared_cache`](crate::BGZFReader::set_shared_cache).
+    pub fn set_shared_cache(&mut self, cache: SharedBlockCache, file_id: u64) {
+        self.source.shared_cache = Some((cache, file_id));
+    }
+
+    /// Seek BGZF with virtual file offset. See [`BGZFReader::bgzf_seek`](crate::BGZFReader::bgzf_seek).
+    pub fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        let source = &mut self.source;
+        self.cache
+            .seek(position, |cache, block| source.load_block(cache, block))
+    }
+
+    /// Get BGZF virtual file offset. See [`BGZFReader::bgzf_pos`](crate::BGZFReader::bgzf_pos).
+    pub fn bgzf_pos(&self) -> u64 {
+        self.cache.position()
+    }
+
+    /// Get a reference to the underlying reader.
+    pub fn get_ref(&self) -> &R {
+        &self.source.reader
+    }
+}
+
+impl<R: ReadAt + Clone> Clone for BGZFPositionalReader<R> {
+    /// Create a reader at the beginning of the same file. Blocks cached by this reader are not copied.
+    fn clone(&self) -> Self {
+        let mut reader = BGZFPositionalReader::new(self.source.reader.clone());
+        reader.source.shared_cache = self.source.shared_cache.clone();
+        reader
+    }
+}
+
+impl<R: ReadAt> BufRead for BGZFPositionalReader<R> {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        let source = &mut self.source;
+        self.cache
+            .fill_buf(|cache, block| source.load_block(cache, block))
+    }
+
+    fn consume(&mut self, amt: usize) {
+        self.cache.consume(amt)
+    }
+}
+
+impl<R: ReadAt> Read for BGZFPositionalReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let source = &mut self.source;
+        self.cache
+            .read(buf, |cache, block| source.load_block(cache, block))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs::File;
+
+    #[test]
+    fn test_positional_read() -> Result<(), BGZFError> {
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut expected)?;
+
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut reader = BGZFPositionalReader::new(&data);
+        let mut result = Vec::new();
+        reader.read_to_end(&mut result)?;
+        assert_eq!(result, expected);
+
+        let file = Arc::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        let reader = BGZFPositionalReader::new(file);
+        let expected = Arc::new(expected);
+        let handles: Vec<_> = (0..4)
+            .map(|i| {
+                let mut reader = reader.clone();
+                let expected = expected.clone();
+                std::thread::spawn(move || -> Result<(), BGZFError> {
+                    for position in [9618658636, 35973, 4210818610, 135183301012]
+                        .iter()
+                        .cycle()
+                        .skip(i)
+                        .take(20)
+                    {
+                        reader.bgzf_seek(*position)?;
+                        let mut line = String::new();
+                        reader.read_line(&mut line)?;
+                        assert!(line.starts_with("1"));
+                    }
+                    reader.bgzf_seek(0)?;
+                    let mut result = Vec::new();
+                    reader.read_to_end(&mut result)?;
+                    assert_eq!(&result, &*expected);
+                    Ok(())
+                })
+            })
+            .collect();
+        for one in handles {
+            one.join().unwrap()?;
+        }
+
+        let mut truncated = BGZFPositionalReader::new(&data[..1000]);
+        assert!(truncated.read_to_end(&mut result).is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,383 @@
+use crate::cache::{BGZFCache, BlockCache, SharedBlockCache, MAX_BLOCK_SIZE};
+use crate::codec::DeflateCodec;
+use crate::read::BlockDecompressor;
+use crate::slice::find_block;
+use crate::tabix::TabixChunk;
+use crate::*;
+use std::collections::{BTreeMap, VecDeque};
+use std::io::{self, BufRead, Read};
+
+/// A remote file which can be read by byte ranges, such as an HTTP server or an object storage.
+///
+/// Implement this trait with an HTTP client (e.g. `Range: bytes=offset-(offset+length-1)`) to use [`BGZFRangeReader`].
+pub trait RangeSource {
+    /// Fetch `length` bytes starting at `offset`. Fewer bytes may be returned only at end of file.
+    fn read_range(&self, offset: u64, length: usize) -> io::Result<Vec<u8>>;
+}
+
+impl<T: RangeSource + ?Sized> RangeSource for &T {
+    fn read_range(&self, offset: u64, length: usize) -> io::Result<Vec<u8>> {
+        (**self).read_range(offset, length)
+    }
+}
+
+const DEFAULT_FETCH_SIZE: usize = 256 * 1024;
+const DEFAULT_COALESCE_GAP: u64 = 1024 * 1024;
+const DEFAULT_FETCHED_BYTE_LIMIT: usize = 64 * 1024 * 1024;
+
+/// Fetched ranges of compressed data.
+struct RangeSourceBlocks<S: RangeSource> {
+    source: S,
+    ranges: BTreeMap<u64, Vec<u8>>,
+    /// Start offsets of ranges in fetched order
+    fetched_order: VecDeque<u64>,
+    fetched_bytes: usize,
+    fetched_byte_limit: usize,
+    fetch_size: usize,
+    coalesce_gap: u64,
+    requests: u64,
+    decompressor: BlockDecompressor,
+    shared_cache: Option<(SharedBlockCache, u64)>,
+}
+
+impl<S: RangeSource> RangeSourceBlocks<S> {
+    /// Find a fetched range containing the whole block at `position`.
+    fn find_fetched(&self, position: u64) -> Result<Option<(u64, usize, usize)>, BGZFError> {
+        if let Some((start, data)) = self.ranges.range(..=position).next_back() {
+            let offset = (position - start) as usize;
+            if offset < data.len() {
+                if let Some((header_size, block_size)) = find_block(&data[offset..])? {
+                    return Ok(Some((*start, offset + header_size, offset + block_size)));
+                }
+            }
+        }
+        Ok(None)
+    }
+
+    fn fetch(&mut self, offset: u64, length: usize) -> io::Result<usize> {
+        let data = self.source.read_range(offset, length)?;
+        self.requests += 1;
+        let fetched = data.len();
+        if fetched == 0 {
+            return Ok(0);
+        }
+        self.fetched_bytes += fetched;
+        if let Some(old) = self.ranges.insert(offset, data) {
+            self.fetched_bytes -= old.len();
+        } else {
+            self.fetched_order.push_back(offset);
+        }
+        // Keep the newest range even if it exceeds the limit
+        while self.fetched_bytes > self.fetched_byte_limit && self.fetched_order.len() > 1 {
+            let oldest = self.fetched_order.pop_front().unwrap();
+            if let Some(old) = self.ranges.remove(&oldest) {
+                self.fetched_bytes -= old.len();
+            }
+        }
+        Ok(fetched)
+    }
+
+    fn load_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some((shared_cache, file_id)) = self.shared_cache.clone() {
+            shared_cache.load(file_id, cache, block_position, |cache, position| {
+                self.inflate_block(cache, position)
+            })
+        } else {
+            self.inflate_block(cache, block_position)
+        }
+    }
+
+    fn inflate_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        let (start, data_begin, block_end) = match self.find_fetched(block_position)? {
+            Some(x) => x,
+            None => {
+                if self.fetch(block_position, self.fetch_size.max(MAX_BLOCK_SIZE))? == 0 {
+                    return Ok(None);
+                }
+                self.find_fetched(block_position)?.ok_or(BGZFError::Other {
+                    message: "Invalid block size",
+                })?
+            }
+        };
+        let data = &self.ranges[&start];
+        let buffer = cache.take_buffer();
+        Ok(Some(self.decompressor.decompress(
+            block_position,
+            start + block_end as u64,
+            &data[data_begin..block_end],
+            buffer,
+        )?))
+    }
+
+    /// Fetch compressed blocks of chunks with a few large requests.
+    fn prefetch(&mut self, chunks: &[TabixChunk]) -> Result<(), BGZFError> {
+        let mut ranges: Vec<(u64, u64)> = chunks
+            .iter()
+            .filter(|x| x.begin < x.end)
+            .map(|x| {
+                // The last block is needed unless the chunk ends at the beginning of a block
+                let end = if x.end & 0xffff == 0 {
+                    x.end >> 16
+                } else {
+                    (x.end >> 16) + MAX_BLOCK_SIZE as u64
+                };
+                (x.begin >> 16, end.max((x.begin >> 16) + 1))
+            })
+            .collect();
+        ranges.sort_unstable();
+
+        let mut merged: Vec<(u64, u64)> = Vec::new();
+        for (begin, end) in ranges {
+            if let Some(last) = merged.last_mut() {
+                if begin <= last.1 + self.coalesce_gap {
+                    last.1 = last.1.max(end);
+                    continue;
+                }
+            }
+            merged.push((begin, end));
+        }
+
+        for (begin, end) in merged {
+            if self.is_fetched(begin, end) {
+                continue;
+            }
+            self.fetch(begin, (end - begin) as usize)?;
+        }
+        Ok(())
+    }
+
+    /// Whether [begin, end) is in one fetched range. The last block may be incomplete.
+    fn is_fetched(&self, begin: u64, end: u64) -> bool {
+        self.ranges
+            .range(..=begin)
+            .next_back()
+            .map(|(start, data)| start + data.len() as u64 >= end)
+            .unwrap_or(false)
+    }
+}
+
+/// A BGZF reader for remote files read by byte ranges
+///
+/// A block not fetched yet is fetched with a range request of the fetch size (256KiB by default),
+/// so sequential reading issues one request per several blocks.
+/// For region queries, [`Tabix::query_records`](crate::tabix::Tabix::query_records) calls
+/// [`BGZFRangeReader::prefetch`], which coalesces blocks of nearby chunks into a few large range requests.
+pub struct BGZFRangeReader<S: RangeSource> {
+    source: RangeSourceBlocks<S>,
+    cache: BlockCache,
+}
+
+impl<S: RangeSource> BGZFRangeReader<S> {
+    /// Create a new BGZF reader from a source of byte ranges
+    pub fn new(source: S) -> Self {
+        BGZFRangeReader {
+            source: RangeSourceBlocks {
+                source,
+                ranges: BTreeMap::new(),
+                fetched_order: VecDeque::new(),
+                fetched_bytes: 0,
+                fetched_byte_limit: DEFAULT_FETCHED_BYTE_LIMIT,
+                fetch_size: DEFAULT_FETCH_SIZE,
+                coalesce_gap: DEFAULT_COALESCE_GAP,
+                requests: 0,
+                decompressor: BlockDecompressor::new(),
+                shared_cache: None,
+            },
+            cache: BlockCache::new(),
+        }
+    }
+
+    /// Set size of a request to fetch a block which is not prefetched. At least 64KiB is fetched.
+    pub fn set_fetch_size(&mut self, bytes: usize) {
+        self.source.fetch_size = bytes;
+    }
+
+    /// Set maximum gap between chunks fetched with one request. Default gap is 1MiB.
+    ///
+    /// Fetching unnecessary bytes in the gap is usually cheaper than another round trip.
+    pub fn set_coalesce_gap(&mut self, bytes: u64) {
+        self.source.coalesce_gap = bytes;
+    }
+
+    /// Set maximum total size of fetched compressed data kept in memory. Default limit is 64MiB.
+    ///
+    /// The oldest fetched range is discarded first.
+    pub fn set_fetched_byte_limit(&mut self, bytes: usize) {
+        self.source.fetched_byte_limit = bytes;
+    }
+
+    /// Set maximum number of inflated blocks kept in the cache, including the current block.
+    pub fn set_cache_limit(&mut self, blocks: usize) {
+        self.cache.set_limit(blocks);
+    }
+
+    /// Inflate blocks with `codec` instead of the default [`Flate2Codec`](crate::Flate2Codec).
+    pub fn set_codec(&mut self, codec: &dyn DeflateCodec) {
+        self.source.decompressor.set_codec(codec);
+    }
+
+    /// Enable or disable CRC32 verification. See [`BGZFReader::set_verify_crc`](crate::BGZFReader::set_verify_crc).
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.source.decompressor.set_verify_crc(verify);
+    }
+
+    /// Share inflated blocks with other readers. See [`BGZFReader::set_shared_cache`](crate::BGZFReader::set_shared_cache).
+    pub fn set_shared_cache(&mut self, cache: SharedBlockCache, file_id: u64) {
+        self.source.shared_cache = Some((cache, file_id));
+    }
+
+    /// Number of range requests issued so far
+    pub fn requests(&self) -> u64 {
+        self.source.requests
+    }
+
+    /// Fetch blocks of `chunks` in advance. Chunks closer than the coalesce gap are fetched with one request.
+    pub fn prefetch(&mut self, chunks: &[TabixChunk]) -> Result<(), BGZFError> {
+        self.source.prefetch(chunks)
+    }
+
+    /// Seek BGZF with virtual file offset. See [`BGZFReader::bgzf_seek`](crate::BGZFReader::bgzf_seek).
+    pub fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        let source = &mut self.source;
+        self.cache
+            .seek(position, |cache, block| source.load_block(cache, block))
+    }
+
+    /// Get BGZF virtual file offset. See [`BGZFReader::bgzf_pos`](crate::BGZFReader::bgzf_pos).
+    pub fn bgzf_pos(&self) -> u64 {
+        self.cache.position()
+    }
+
+    /// Get a reference to the underlying source.
+    pub fn get_ref(&self) -> &S {
+        &self.source.source
+    }
+}
+
+impl<S: RangeSource> BufRead for BGZFRangeReader<S> {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        let source = &mut self.source;
+        self.cache
+            .fill_buf(|cache, block| source.load_block(cache, block))
+    }
+
+    fn consume(&mut self, amt: usize) {
+        self.cache.consume(amt)
+    }
+}
+
+impl<S: RangeSource> Read for BGZFRangeReader<S> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let source = &mut self.source;
+        self.cache
+            .read(buf, |cache, block| source.load_block(cache, block))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::tabix::Tabix;
+    use std::fs::File;
+    use std::sync::Mutex;
+
+    struct MockSource {
+        data: Vec<u8>,
+        fetched: Mutex<Vec<(u64, usize)>>,
+    }
+
+    impl RangeSource for MockSource {
+        fn read_range(&self, offset: u64, length: usize) -> io::Result<Vec<u8>> {
+            self.fetched.lock().unwrap().push((offset, length));
+            let begin = (offset as usize).min(self.data.len());
+            let end = (begin + length).min(self.data.len());
+            Ok(self.data[begin..end].to_vec())
+        }
+    }
+
+    #[test]
+    fn test_range_reader() -> Result<(), BGZFError> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&data[..]).read_to_end(&mut expected)?;
+        let source = MockSource {
+            data: data.clone(),
+            fetched: Mutex::new(Vec::new()),
+        };
+
+        let mut reader = BGZFRangeReader::new(&source);
+        let mut result = Vec::new();
+        reader.read_to_end(&mut result)?;
+        assert_eq!(result, expected);
+        // The last block of each fetched range may be incomplete and fetched again
+        assert!(
+            reader.requests() <= (data.len() / (DEFAULT_FETCH_SIZE - MAX_BLOCK_SIZE)) as u64 + 2
+        );
+
+        let tabix = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        let mut file_reader =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        for (sequence, begin, end) in [
+            ("1", 1_000_000, 20_000_000),
+            ("2", 100_000_000, 150_000_000),
+            ("X", 155_000_000, 170_000_000),
+        ]
+        .iter()
+        {
+            let sequence_id = tabix.sequence_id(sequence.as_bytes()).unwrap();
+            let mut reader = BGZFRangeReader::new(&source);
+            let records: Vec<Vec<u8>> = tabix
+                .query_records(&mut reader, sequence_id, *begin, *end)
+                .collect::<io::Result<_>>()?;
+            let expected: Vec<Vec<u8>> = tabix
+                .query_records(&mut file_reader, sequence_id, *begin, *end)
+                .collect::<io::Result<_>>()?;
+            assert!(!records.is_empty());
+            assert_eq!(records, expected);
+            assert_eq!(reader.requests(), 1);
+        }
+
+        // Chunks of several regions are coalesced into one request
+        let mut reader = BGZFRangeReader::new(&source);
+        reader.set_coalesce_gap(data.len() as u64);
+        let mut chunks = tabix.query(tabix.sequence_id(b"1").unwrap(), 0, 2_000_000);
+        chunks.extend(tabix.query(tabix.sequence_id(b"X").unwrap(), 155_000_000, 170_000_000));
+        reader.prefetch(&chunks)?;
+        assert_eq!(reader.requests(), 1);
+        for one in chunks {
+            reader.bgzf_seek(one.begin)?;
+            reader.fill_buf()?;
+        }
+        assert_eq!(reader.requests(), 1);
+
+        // Far chunks are fetched separately without coalescing
+        let mut reader = BGZFRangeReader::new(&source);
+        reader.set_coalesce_gap(0);
+        source.fetched.lock().unwrap().clear();
+        reader.prefetch(&[
+            TabixChunk {
+                begin: 35973,
+                end: 100 << 16,
+            },
+            TabixChunk {
+                begin: 2_000_000 << 16,
+                end: 2_000_000 << 16 | 10,
+            },
+        ])?;
+        assert_eq!(
+            *source.fetched.lock().unwrap(),
+            vec![(0, 100), (2_000_000, MAX_BLOCK_SIZE)]
+        );
+        Ok(())
+    }
+}
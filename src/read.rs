@@ -1,19 +1,347 @@
-use crate::header::BGZFHeader;
+use crate::cache::{BGZFCache, BlockCache, BlockData, SharedBlockCache, MAX_BLOCK_SIZE};
+use crate::codec::{BlockInflater, DeflateCodec, Flate2Codec};
+use crate::header::{fixed_header_block_size, BGZFHeader, BGZF_HEADER_SIZE};
+use crate::slice::find_block;
+use crate::stats::{InflateStats, ReaderStats};
+use crate::worker::OrderedWorkers;
 use crate::*;
-use std::collections::HashMap;
+use std::collections::VecDeque;
+use std::convert::TryInto;
 use std::io;
 use std::io::prelude::*;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
-struct BGZFCache {
-    position: u64,
-    header: BGZFHeader,
-    buffer: Vec<u8>,
+/// A block read from the file but not inflated yet.
+pub(crate) struct RawBlock {
+    pub position: u64,
+    pub next_position: u64,
+    /// Compressed data, CRC32 and uncompressed size
+    pub data: Vec<u8>,
+}
+
+/// Read a header and compressed data, CRC32 and size of a block at compressed file offset `block_position`
+/// without inflating. The data is stored in `data`. Returns `None` at end of file.
+pub(crate) fn read_raw_block<R: Read>(
+    reader: &mut io::BufReader<R>,
+    block_position: u64,
+    mut data: Vec<u8>,
+) -> Result<Option<RawBlock>, BGZFError> {
+    let buf = reader.fill_buf()?;
+    if buf.is_empty() {
+        return Ok(None);
+    }
+    let (header_size, block_size) = match fixed_header_block_size(buf) {
+        Some(block_size) => {
+            reader.consume(BGZF_HEADER_SIZE);
+            (BGZF_HEADER_SIZE as u64, block_size as u64)
+        }
+        None => {
+            let header = BGZFHeader::from_reader(reader)?;
+            (header.header_size(), u64::from(header.block_size()?) + 1)
+        }
+    };
+    let raw_size = block_size
+        .checked_sub(header_size)
+        .filter(|x| *x >= 8)
+        .ok_or(BGZFError::Other {
+            message: "Invalid block size",
+        })?;
+    data.clear();
+    data.resize(raw_size as usize, 0);
+    reader.read_exact(&mut data)?;
+    Ok(Some(RawBlock {
+        position: block_position,
+        next_position: block_position + block_size,
+        data,
+    }))
+}
+
+/// Reusable inflater state for BGZF blocks.
+pub(crate) struct BlockDecompressor {
+    inflater: Box<dyn BlockInflater>,
+    verify_crc: bool,
+    stats: InflateStats,
+}
+
+impl BlockDecompressor {
+    pub fn new() -> Self {
+        BlockDecompressor::with_codec(&Flate2Codec)
+    }
+
+    pub fn with_codec(codec: &dyn DeflateCodec) -> Self {
+        BlockDecompressor {
+            inflater: codec.inflater(),
+            verify_crc: true,
+            stats: InflateStats::default(),
+        }
+    }
+
+    /// Replace the codec keeping other settings.
+    pub fn set_codec(&mut self, codec: &dyn DeflateCodec) {
+        self.inflater = codec.inflater();
+    }
+
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.verify_crc = verify;
+    }
+
+    pub fn verify_crc(&self) -> bool {
+        self.verify_crc
+    }
+
+    pub fn stats(&self) -> InflateStats {
+        self.stats
+    }
+
+    /// Get counters and reset them.
+    pub fn take_stats(&mut self) -> InflateStats {
+        std::mem::take(&mut self.stats)
+    }
+
+    /// Inflate compressed data into `buffer` and verify CRC32 and size stored in the footer.
+    /// CRC32 is not verified if it is disabled with `set_verify_crc`.
+    ///
+    /// `data` is a block without header, that is compressed data, CRC32 and uncompressed size.
+    pub fn decompress(
+        &mut self,
+        position: u64,
+        next_position: u64,
+        data: &[u8],
+        mut buffer: Vec<u8>,
+    ) -> Result<BGZFCache, BGZFError> {
+        #[cfg(feature = "tracing")]
+        let _span = tracing::trace_span!("bgzf_inflate", position).entered();
+        let start = Instant::now();
+        buffer.clear();
+        let result = self.append_block(data, &mut buffer);
+        self.stats.time += start.elapsed();
+        result?;
+        self.stats.blocks += 1;
+        self.stats.compressed_bytes += next_position - position;
+        self.stats.uncompressed_bytes += buffer.len() as u64;
+        Ok(BGZFCache {
+            position,
+            next_position,
+            buffer: BlockData::Owned(buffer),
+        })
+    }
+
+    /// Inflate a block without header and append the data to `output`.
+    fn append_block(&mut self, data: &[u8], output: &mut Vec<u8>) -> Result<(), BGZFError> {
+        let (compressed, footer) = data.split_at(data.len() - 8);
+        let crc32 = u32::from_le_bytes(footer[..4].try_into().unwrap());
+        let raw_length = u32::from_le_bytes(footer[4..].try_into().unwrap()) as usize;
+        if raw_length > MAX_BLOCK_SIZE {
+            return Err(BGZFError::Other {
+                message: "Unmatched length",
+            });
+        }
+
+        let start = output.len();
+        self.inflater.inflate(compressed, output, raw_length)?;
+        if raw_length != output.len() - start {
+            return Err(BGZFError::Other {
+                message: "Unmatched length",
+            });
+        }
+
+        if self.verify_crc && crc32 != crc32fast::hash(&output[start..]) {
+            return Err(BGZFError::Other {
+                message: "Unmatched CRC32",
+            });
+        }
+        Ok(())
+    }
+
+    /// Inflate consecutive whole blocks with headers and append the data to `output`.
+    pub fn decompress_blocks(
+        &mut self,
+        mut data: &[u8],
+        output: &mut Vec<u8>,
+    ) -> Result<(), BGZFError> {
+        while !data.is_empty() {
+            let (header_size, block_size) = find_block(data)?.ok_or(BGZFError::Other {
+                message: "Invalid block size",
+            })?;
+            self.append_block(&data[header_size..block_size], output)?;
+            data = &data[block_size..];
+        }
+        Ok(())
+    }
 }
 
-impl BGZFCache {
-    fn next_block_position(&self) -> u64 {
-        let block_size: u64 = self.header.block_size().unwrap().into();
-        self.position + block_size + 1
+/// Buffer of compressed data, result and counters of a block inflated by a worker thread
+pub(crate) type InflatedBlock = (Vec<u8>, Result<BGZFCache, BGZFError>, InflateStats);
+
+/// Blocks read from the file and being inflated by worker threads.
+pub(crate) struct ReadAhead {
+    pub workers: OrderedWorkers<(RawBlock, Vec<u8>, bool), InflatedBlock>,
+    /// Counters of worker threads
+    pub stats: InflateStats,
+    pub positions: VecDeque<u64>,
+    pub next_position: u64,
+    pub stopped: bool,
+}
+
+impl ReadAhead {
+    /// Spawn `threads` worker threads inflating blocks with `codec`.
+    pub fn new(threads: usize, codec: Arc<dyn DeflateCodec>) -> Self {
+        ReadAhead {
+            workers: OrderedWorkers::new(threads, move || {
+                let mut decompressor = BlockDecompressor::with_codec(&*codec);
+                move |(raw, buffer, verify_crc): (RawBlock, Vec<u8>, bool)| {
+                    decompressor.set_verify_crc(verify_crc);
+                    let result =
+                        decompressor.decompress(raw.position, raw.next_position, &raw.data, buffer);
+                    (raw.data, result, decompressor.take_stats())
+                }
+            }),
+            stats: InflateStats::default(),
+            positions: VecDeque::new(),
+            next_position: 0,
+            stopped: false,
+        }
+    }
+}
+
+/// Loads blocks from seekable reader.
+struct SeekableSource<R: Read + Seek> {
+    reader: io::BufReader<R>,
+    reader_position: u64,
+    read_ahead: Option<ReadAhead>,
+    decompressor: BlockDecompressor,
+    shared_cache: Option<(SharedBlockCache, u64)>,
+    io_time: Duration,
+}
+
+impl<R: Read + Seek> SeekableSource<R> {
+    fn load_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some((shared_cache, file_id)) = self.shared_cache.clone() {
+            shared_cache.load(file_id, cache, block_position, |cache, position| {
+                self.inflate_block(cache, position)
+            })
+        } else {
+            self.inflate_block(cache, block_position)
+        }
+    }
+
+    fn inflate_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some(mut read_ahead) = self.read_ahead.take() {
+            let result = self.load_block_with_read_ahead(cache, &mut read_ahead, block_position);
+            self.read_ahead = Some(read_ahead);
+            result
+        } else {
+            self.load_block_without_read_ahead(cache, block_position)
+        }
+    }
+
+    fn load_block_without_read_ahead(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some(raw) = self.read_raw_block(cache, block_position)? {
+            let buffer = cache.take_buffer();
+            let result =
+                self.decompressor
+                    .decompress(raw.position, raw.next_position, &raw.data, buffer);
+            cache.recycle_buffer(raw.data);
+            Ok(Some(result?))
+        } else {
+            Ok(None)
+        }
+    }
+
+    fn load_block_with_read_ahead(
+        &mut self,
+        cache: &mut BlockCache,
+        read_ahead: &mut ReadAhead,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if !read_ahead.positions.contains(&block_position) {
+            // Random access. Discard blocks in flight and restart read-ahead.
+            while let Some((raw, result, stats)) = read_ahead.workers.recv() {
+                read_ahead.stats.add(&stats);
+                cache.recycle_buffer(raw);
+                if let Ok(block) = result {
+                    cache.recycle_block(block);
+                }
+            }
+            read_ahead.positions.clear();
+            read_ahead.next_position = block_position;
+            read_ahead.stopped = false;
+        }
+        self.fill_read_ahead(cache, read_ahead);
+
+        while let Some(position) = read_ahead.positions.pop_front() {
+            let (raw, result, stats) = read_ahead.workers.recv().unwrap();
+            read_ahead.stats.add(&stats);
+            cache.recycle_buffer(raw);
+            if position == block_position {
+                self.fill_read_ahead(cache, read_ahead);
+                return result.map(Some);
+            }
+        }
+
+        // Failed to read the block in advance. Load it again to report an error or end of file.
+        self.load_block_without_read_ahead(cache, block_position)
+    }
+
+    fn fill_read_ahead(&mut self, cache: &mut BlockCache, read_ahead: &mut ReadAhead) {
+        while !read_ahead.stopped
+            && read_ahead.workers.in_flight() < read_ahead.workers.threads() * 2
+        {
+            let position = read_ahead.next_position;
+            match self.read_raw_block(cache, position) {
+                Ok(Some(raw)) => {
+                    read_ahead.next_position = raw.next_position;
+                    read_ahead.positions.push_back(position);
+                    let buffer = cache.take_buffer();
+                    read_ahead
+                        .workers
+                        .submit((raw, buffer, self.decompressor.verify_crc()));
+                }
+                Ok(None) | Err(_) => read_ahead.stopped = true,
+            }
+        }
+    }
+
+    /// Read a header and compressed data, CRC32 and size of a block without inflating.
+    /// Returns `None` at end of file.
+    fn read_raw_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<RawBlock>, BGZFError> {
+        let start = Instant::now();
+        let result = self.read_raw_block_untimed(cache, block_position);
+        self.io_time += start.elapsed();
+        result
+    }
+
+    fn read_raw_block_untimed(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<RawBlock>, BGZFError> {
+        if self.reader_position != block_position {
+            self.reader.seek(io::SeekFrom::Start(block_position))?;
+        }
+        self.reader_position = u64::MAX;
+        let raw = read_raw_block(&mut self.reader, block_position, cache.take_buffer())?;
+        if let Some(raw) = raw.as_ref() {
+            self.reader_position = raw.next_position;
+        }
+        Ok(raw)
     }
 }
 
@@ -21,16 +349,11 @@ impl BGZFCache {
 ///
 /// Decode BGZF file with seek support.
 pub struct BGZFReader<R: Read + Seek> {
-    reader: io::BufReader<R>,
-    cache: HashMap<u64, BGZFCache>,
-    cache_order: Vec<u64>,
-    cache_limit: usize,
-    current_block: u64,
-    current_position_in_block: usize,
+    source: SeekableSource<R>,
+    cache: BlockCache,
+    gzi: Option<gzi::GZI>,
 }
 
-const DEFAULT_CACHE_LIMIT: usize = 10;
-
 impl<R: Read + Seek> BGZFReader<R> {
     /// Create a new BGZF reader from std::io::Read
     pub fn new(reader: R) -> Self {
@@ -40,143 +363,266 @@ impl<R: Read + Seek> BGZFReader<R> {
     /// Create a new BGZF reader from std::io::BufReader    
     pub fn with_buf_reader(reader: io::BufReader<R>) -> Self {
         BGZFReader {
-            reader,
-            cache: HashMap::new(),
-            cache_order: Vec::with_capacity(DEFAULT_CACHE_LIMIT),
-            current_block: 0,
-            cache_limit: DEFAULT_CACHE_LIMIT,
-            current_position_in_block: 0,
+            source: SeekableSource {
+                reader,
+                reader_position: u64::MAX,
+                read_ahead: None,
+                decompressor: BlockDecompressor::new(),
+                shared_cache: None,
+                io_time: Duration::default(),
+            },
+            cache: BlockCache::new(),
+            gzi: None,
+        }
+    }
+
+    /// Create a new BGZF reader with parallel read-ahead.
+    ///
+    /// While sequential reading, `threads` worker threads inflate following blocks in advance.
+    pub fn with_threads(reader: R, threads: usize) -> Self {
+        BGZFReader::with_codec(reader, threads, Arc::new(Flate2Codec))
+    }
+
+    /// Create a new BGZF reader which inflates blocks with `codec`.
+    ///
+    /// See [`BGZFReader::with_threads`] for `threads`.
+    pub fn with_codec(reader: R, threads: usize, codec: Arc<dyn DeflateCodec>) -> Self {
+        let mut bgzf_reader = BGZFReader::new(reader);
+        bgzf_reader.source.decompressor.set_codec(&*codec);
+        if threads > 1 {
+            bgzf_reader.source.read_ahead = Some(ReadAhead::new(threads, codec));
+        }
+        bgzf_reader
+    }
+
+    /// Set maximum number of inflated blocks kept in the cache, including the current block.
+    ///
+    /// The least recently used block is evicted first. Default limit is 10 blocks.
+    pub fn set_cache_limit(&mut self, blocks: usize) {
+        self.cache.set_limit(blocks);
+    }
+
+    /// Set maximum total size of inflated blocks kept in the cache in bytes.
+    ///
+    /// The current block is always kept even if it exceeds the limit. No limit by default.
+    pub fn set_cache_byte_limit(&mut self, bytes: usize) {
+        self.cache.set_byte_limit(bytes);
+    }
+
+    /// Counters of this reader. Counting is cheap enough to be always enabled.
+    ///
+    /// Blocks found in a [`SharedBlockCache`] are counted as cache misses, but not as inflated blocks.
+    pub fn stats(&self) -> ReaderStats {
+        let mut inflate = self.source.decompressor.stats();
+        if let Some(read_ahead) = self.source.read_ahead.as_ref() {
+            inflate.add(&read_ahead.stats);
         }
+        let cache = self.cache.stats();
+        ReaderStats {
+            blocks_inflated: inflate.blocks,
+            cache_hits: cache.hits,
+            cache_misses: cache.misses,
+            cache_evictions: cache.evictions,
+            compressed_bytes: inflate.compressed_bytes,
+            uncompressed_bytes: inflate.uncompressed_bytes,
+            seeks: cache.seeks,
+            codec_time: inflate.time,
+            io_time: self.source.io_time,
+        }
+    }
+
+    /// Enable or disable CRC32 verification of inflated blocks. Enabled by default.
+    ///
+    /// Skipping verification is a little faster, but corruption of data is not detected. Disable it only for trusted files.
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.source.decompressor.set_verify_crc(verify);
     }
 
     /// Seek BGZF with position. This position is not equal to real file offset,
     /// but equal to virtual file offset described in [BGZF format](https://samtools.github.io/hts-specs/SAMv1.pdf).
     /// Please read "4.1.1 Random access" to learn more.
     pub fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
-        self.current_block = position >> 16;
-        self.current_position_in_block = (position & 0xffff) as usize;
-        // println!(
-        //     "Seek {} {} {}",
-        //     position, self.current_block, self.current_position_in_block
-        // );
-        self.load_cache(self.current_block)?;
-        Ok(())
+        let source = &mut self.source;
+        self.cache
+            .seek(position, |cache, block| source.load_block(cache, block))
     }
 
     /// Get BGZF virtual file offset. This position is not equal to real file offset,
     /// but equal to virtual file offset described in [BGZF format](https://samtools.github.io/hts-specs/SAMv1.pdf).
     /// Please read "4.1.1 Random access" to learn more.    
     pub fn bgzf_pos(&self) -> u64 {
-        self.current_block << 16 | (self.current_position_in_block & 0xffff) as u64
+        self.cache.position()
     }
 
-    fn load_cache(&mut self, block_position: u64) -> Result<(), BGZFError> {
-        if self.cache.contains_key(&block_position) {
-            return Ok(());
-        }
-        if self.cache_limit <= self.cache_order.len() {
-            let remove_block = self.cache_order.remove(0);
-            self.cache.remove(&remove_block);
-        }
-        self.reader.seek(io::SeekFrom::Start(block_position))?;
-
-        let header = BGZFHeader::from_reader(&mut self.reader)?;
-        let mut buffer: Vec<u8> = Vec::with_capacity(1024 * 32);
-        let loaded_crc32 = {
-            let mut inflate =
-                flate2::CrcReader::new(flate2::bufread::DeflateDecoder::new(&mut self.reader));
-            inflate.read_to_end(&mut buffer)?;
-            inflate.crc().sum()
-        };
+    /// Share inflated blocks with other readers through `cache`.
+    ///
+    /// Readers of the same file must use the same `file_id`, which can be allocated by [`SharedBlockCache::new_file_id`].
+    /// Blocks are still kept in the cache of this reader as well.
+    pub fn set_shared_cache(&mut self, cache: SharedBlockCache, file_id: u64) {
+        self.source.shared_cache = Some((cache, file_id));
+    }
 
-        let crc32 = self.reader.read_le_u32()?;
-        let raw_length = self.reader.read_le_u32()?;
-        if raw_length != buffer.len() as u32 {
-            return Err(BGZFError::Other {
-                message: "Unmatched length",
-            });
-        }
-        if crc32 != loaded_crc32 {
-            return Err(BGZFError::Other {
-                message: "Unmatched CRC32",
-            });
-        }
-        self.cache_order.push(block_position);
-        self.cache.insert(
-            block_position,
-            BGZFCache {
-                position: block_position,
-                header,
-                buffer,
-            },
-        );
+    /// Set GZI index used by [`BGZFReader::seek_uncompressed`].
+    pub fn set_gzi(&mut self, gzi: gzi::GZI) {
+        self.gzi = Some(gzi);
+    }
 
-        Ok(())
+    /// Seek to offset in uncompressed data with GZI index.
+    ///
+    /// The block is found by binary search over the index, and then data in the block is skipped.
+    /// Seeking beyond end of data moves to end of data. Returns an error if GZI index is not set.
+    pub fn seek_uncompressed(&mut self, position: u64) -> Result<(), BGZFError> {
+        let gzi = self.gzi.take().ok_or(BGZFError::Other {
+            message: "GZI index is not set",
+        })?;
+        let result = gzi::seek_uncompressed(self, &gzi, position);
+        self.gzi = Some(gzi);
+        result
     }
 }
 
 impl<R: Read + Seek> BufRead for BGZFReader<R> {
     fn fill_buf(&mut self) -> io::Result<&[u8]> {
-        if !self.cache.contains_key(&self.current_block) {
-            self.load_cache(self.current_block)
-                .map_err(|x| io::Error::new(io::ErrorKind::Other, format!("{}", x)))?;
-        }
+        let source = &mut self.source;
+        self.cache
+            .fill_buf(|cache, block| source.load_block(cache, block))
+    }
 
-        let block = self.cache.get(&self.current_block).unwrap();
-        let remain_bytes = block.buffer.len() - self.current_position_in_block;
-        if remain_bytes > 0 {
-            return Ok(&block.buffer[self.current_position_in_block..]);
+    fn consume(&mut self, amt: usize) {
+        self.cache.consume(amt)
+    }
+}
+
+impl<R: Read + Seek> Read for BGZFReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let source = &mut self.source;
+        self.cache
+            .read(buf, |cache, block| source.load_block(cache, block))
+    }
+}
+
+/// Size of compressed data in one batch of [`BlockBatches`]
+const PARALLEL_BATCH_SIZE: usize = 1024 * 1024;
+
+/// Reads whole blocks of BGZF data in batches of about 1MiB without inflating, to be processed by worker threads.
+pub(crate) struct BlockBatches<R: Read> {
+    reader: R,
+    /// A part of a block read with the previous batch
+    remain: Vec<u8>,
+    /// Compressed file offset of the next batch
+    position: u64,
+    end_of_file: bool,
+}
+
+impl<R: Read> BlockBatches<R> {
+    pub fn new(reader: R) -> Self {
+        BlockBatches {
+            reader,
+            remain: Vec::new(),
+            position: 0,
+            end_of_file: false,
         }
-        Ok(&[])
     }
 
-    fn consume(&mut self, amt: usize) {
-        let block = self.cache.get(&self.current_block).unwrap();
-        let remain_bytes = block.buffer.len() - self.current_position_in_block;
-        if amt <= remain_bytes {
-            self.current_position_in_block += amt;
-            if self.current_position_in_block == block.buffer.len() {
-                self.current_block = block.next_block_position();
-                self.current_position_in_block = 0;
+    /// Whether all blocks are read
+    pub fn is_finished(&self) -> bool {
+        self.end_of_file
+    }
+
+    /// Compressed file offset of the next batch. After the last batch, this is the size of BGZF data.
+    pub fn position(&self) -> u64 {
+        self.position
+    }
+
+    /// Read the next batch of blocks into `batch`, and return it with its compressed file offset.
+    ///
+    /// Returns `None` after the last block. A block truncated at end of file is an error.
+    pub fn next_batch(&mut self, mut batch: Vec<u8>) -> Result<Option<(u64, Vec<u8>)>, BGZFError> {
+        if self.end_of_file {
+            return Ok(None);
+        }
+        batch.clear();
+        batch.append(&mut self.remain);
+        let request = PARALLEL_BATCH_SIZE - batch.len().min(PARALLEL_BATCH_SIZE);
+        let read = (&mut self.reader)
+            .take(request as u64)
+            .read_to_end(&mut batch)?;
+        self.end_of_file = read < request;
+
+        let mut blocks_end = 0;
+        while let Some((_, block_size)) = find_block(&batch[blocks_end..])? {
+            blocks_end += block_size;
+        }
+        self.remain.extend_from_slice(&batch[blocks_end..]);
+        batch.truncate(blocks_end);
+        if self.end_of_file {
+            if !self.remain.is_empty() {
+                return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "Truncated block").into());
+            }
+            if batch.is_empty() {
+                return Ok(None);
             }
-        } else {
-            unreachable!()
         }
+        let position = self.position;
+        self.position += batch.len() as u64;
+        Ok(Some((position, batch)))
     }
 }
 
-impl<R: Read + Seek> Read for BGZFReader<R> {
-    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
-        if !self.cache.contains_key(&self.current_block) {
-            self.load_cache(self.current_block)
-                .map_err(|x| io::Error::new(io::ErrorKind::Other, format!("{}", x)))?;
-        }
-        let block = self.cache.get(&self.current_block).unwrap();
-        let load_size = buf
-            .len()
-            .min(block.buffer.len() - self.current_position_in_block);
-        buf[..load_size].copy_from_slice(
-            &block.buffer
-                [self.current_position_in_block..(self.current_position_in_block + load_size)],
-        );
-        let extra_read_size = if load_size != buf.len() {
-            //println!("additional load");
-            self.current_block = block.next_block_position();
-            self.current_position_in_block = 0;
-            self.read(&mut buf[load_size..])?
-        } else {
-            //println!("OK");
-            self.current_position_in_block += load_size;
-            if self.current_position_in_block == block.buffer.len() {
-                println!("Prepare");
-                self.current_block = block.next_block_position();
-                self.current_position_in_block = 0;
+/// Decompress whole BGZF data from `reader` into `writer` with `threads` worker threads.
+///
+/// Blocks are located with their headers without inflating, and batches of blocks are inflated
+/// in parallel and written in order. Returns the size of decompressed data.
+/// ```
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let mut data = Vec::new();
+/// let file = std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+/// let length = bgzip::decompress_parallel(file, &mut data, 4)?;
+/// assert_eq!(length, data.len() as u64);
+/// assert!(data.starts_with(b"##fileformat=VCFv4.0\n"));
+/// # Ok(())
+/// # }
+/// ```
+pub fn decompress_parallel<R: Read, W: Write>(
+    reader: R,
+    mut writer: W,
+    threads: usize,
+) -> Result<u64, BGZFError> {
+    let mut workers = OrderedWorkers::new(threads, || {
+        let mut decompressor = BlockDecompressor::new();
+        move |(raw, mut output): (Vec<u8>, Vec<u8>)| {
+            output.clear();
+            let result = decompressor
+                .decompress_blocks(&raw, &mut output)
+                .map(|_| output);
+            (raw, result)
+        }
+    });
+    let mut batches = BlockBatches::new(reader);
+    let mut raw_pool: Vec<Vec<u8>> = Vec::new();
+    let mut output_pool: Vec<Vec<u8>> = Vec::new();
+    let mut total = 0;
+
+    loop {
+        while !batches.is_finished() && workers.in_flight() < workers.threads() * 2 {
+            if let Some((_, raw)) = batches.next_batch(raw_pool.pop().unwrap_or_default())? {
+                let output = output_pool.pop().unwrap_or_default();
+                workers.submit((raw, output));
             }
-            0
-        };
+        }
 
-        Ok(load_size + extra_read_size)
+        if let Some((raw, result)) = workers.recv() {
+            raw_pool.push(raw);
+            let output = result?;
+            writer.write_all(&output)?;
+            total += output.len() as u64;
+            output_pool.push(output);
+        } else {
+            break;
+        }
     }
+    writer.flush()?;
+    Ok(total)
 }
 
 #[cfg(test)]
@@ -214,7 +660,7 @@ mod test {
         assert_eq!(reader.bgzf_pos(), 35973);
         reader.read_exact(&mut buffer)?;
         assert!(buffer.starts_with(b"1\t"));
-        reader.bgzf_seek(reader.cache.get(&0).unwrap().next_block_position() << 16)?;
+        reader.bgzf_seek(reader.cache.current().unwrap().next_block_position() << 16)?;
         reader.bgzf_seek(4210818610)?;
         assert_eq!(reader.bgzf_pos(), 4210818610);
         reader.read_exact(&mut buffer)?;
@@ -229,4 +675,198 @@ mod test {
         assert!(buffer.starts_with(b"11\t"));
         Ok(())
     }
+
+    #[test]
+    fn test_read_ahead() -> Result<(), BGZFError> {
+        let mut expected_reader = io::BufReader::new(flate2::read::MultiGzDecoder::new(
+            File::open("testfiles/common_all_20180418_half.vcf.gz")?,
+        ));
+        let mut reader =
+            BGZFReader::with_threads(File::open("testfiles/common_all_20180418_half.vcf.gz")?, 4);
+
+        let mut line1 = String::new();
+        let mut line2 = String::new();
+        loop {
+            line1.clear();
+            line2.clear();
+            let read_len1 = reader.read_line(&mut line1)?;
+            let read_len2 = expected_reader.read_line(&mut line2)?;
+            assert_eq!(line1, line2);
+            if read_len1 == 0 {
+                assert_eq!(read_len2, 0);
+                break;
+            }
+        }
+
+        let mut buffer: [u8; 8] = [0; 8];
+        reader.bgzf_seek(9618658636)?;
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"1\t"));
+        reader.bgzf_seek(4210818610)?;
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"1\t"));
+        Ok(())
+    }
+
+    #[test]
+    fn test_cache_limit() -> Result<(), BGZFError> {
+        let mut reader = BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        let mut buffer: [u8; 8] = [0; 8];
+        reader.set_cache_limit(3);
+        for position in [35973, 4210818610, 9618658636, 35973, 135183301012].iter() {
+            reader.bgzf_seek(*position)?;
+            reader.read_exact(&mut buffer)?;
+            assert!(buffer.starts_with(b"1"));
+            assert!(reader.cache.len() < 3);
+        }
+        // The block of 4210818610 is least recently used
+        assert!(reader.cache.contains(35973 >> 16));
+        assert!(reader.cache.contains(9618658636 >> 16));
+        assert!(!reader.cache.contains(4210818610 >> 16));
+
+        reader.set_cache_byte_limit(0);
+        assert_eq!(reader.cache.len(), 0);
+        assert_eq!(
+            reader.cache.cached_bytes(),
+            reader.cache.current().unwrap().buffer.len()
+        );
+        reader.bgzf_seek(9618658636)?;
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"1\t"));
+        assert_eq!(reader.cache.len(), 0);
+        Ok(())
+    }
+
+    #[test]
+    fn test_concatenated() -> Result<(), BGZFError> {
+        let mut data = Vec::new();
+        for one in [&b"hello, "[..], &b"world"[..]].iter() {
+            let mut writer = crate::BGZFWriter::new(&mut data, flate2::Compression::default());
+            writer.write_all(one)?;
+            writer.close()?;
+        }
+        let mut reader = BGZFReader::new(io::Cursor::new(data));
+        let mut result = String::new();
+        reader.read_to_string(&mut result)?;
+        assert_eq!(result, "hello, world");
+        assert_eq!(reader.read(&mut [0; 10])?, 0);
+        Ok(())
+    }
+
+    #[test]
+    fn test_corrupted() -> Result<(), BGZFError> {
+        let mut data = Vec::new();
+        let mut writer = crate::BGZFWriter::new(&mut data, flate2::Compression::default());
+        writer.write_all(b"hello, world")?;
+        writer.close()?;
+
+        let mut broken_crc = data.clone();
+        broken_crc[data.len() - 28 - 8] ^= 1;
+        let mut reader = BGZFReader::new(io::Cursor::new(&broken_crc));
+        assert!(reader.read(&mut [0; 10]).is_err());
+        for threads in [1, 2].iter() {
+            let mut reader = BGZFReader::with_threads(io::Cursor::new(&broken_crc), *threads);
+            reader.set_verify_crc(false);
+            let mut buffer = Vec::new();
+            reader.read_to_end(&mut buffer)?;
+            assert_eq!(buffer, b"hello, world");
+        }
+
+        let mut broken_length = data.clone();
+        broken_length[data.len() - 28 - 4] ^= 1;
+        let mut reader = BGZFReader::new(io::Cursor::new(broken_length));
+        assert!(reader.read(&mut [0; 10]).is_err());
+
+        let mut reader = BGZFReader::new(io::Cursor::new(data));
+        let mut buffer = [0; 12];
+        reader.read_exact(&mut buffer)?;
+        assert_eq!(&buffer, b"hello, world");
+        Ok(())
+    }
+
+    #[test]
+    fn test_shared_cache() -> Result<(), BGZFError> {
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut expected)?;
+
+        let cache = SharedBlockCache::new(usize::MAX);
+        let file_id = cache.new_file_id();
+        assert_ne!(file_id, cache.new_file_id());
+        let mut reader = BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        reader.set_shared_cache(cache.clone(), file_id);
+        let mut data = Vec::new();
+        reader.read_to_end(&mut data)?;
+        assert_eq!(data, expected);
+        assert_eq!(cache.cached_bytes(), expected.len());
+
+        // All blocks are served by the shared cache without the underlying file
+        let mut cached_reader = BGZFReader::new(io::Cursor::new(Vec::<u8>::new()));
+        cached_reader.set_shared_cache(cache.clone(), file_id);
+        data.clear();
+        cached_reader.read_to_end(&mut data)?;
+        assert_eq!(data, expected);
+        cached_reader.bgzf_seek(4210818610)?;
+        let mut buffer = [0; 2];
+        cached_reader.read_exact(&mut buffer)?;
+        assert_eq!(&buffer, b"1\t");
+
+        let limited = SharedBlockCache::new(1 << 20);
+        let mut reader = BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        reader.set_shared_cache(limited.clone(), 0);
+        data.clear();
+        reader.read_to_end(&mut data)?;
+        assert_eq!(data, expected);
+        assert!(limited.cached_bytes() <= 1 << 20);
+        Ok(())
+    }
+
+    #[test]
+    fn test_decompress_parallel() -> Result<(), BGZFError> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&data[..]).read_to_end(&mut expected)?;
+
+        for threads in [1, 3].iter() {
+            let mut result = Vec::new();
+            let length = decompress_parallel(&data[..], &mut result, *threads)?;
+            assert_eq!(length, expected.len() as u64);
+            assert_eq!(result, expected);
+        }
+
+        assert!(decompress_parallel(&data[..(data.len() - 100)], &mut Vec::new(), 2).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_stats() -> Result<(), BGZFError> {
+        let data = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&data[..]).read_to_end(&mut expected)?;
+
+        for threads in [1, 3].iter() {
+            let mut reader = BGZFReader::with_threads(io::Cursor::new(&data), *threads);
+            io::copy(&mut reader, &mut io::sink())?;
+            let stats = reader.stats();
+            // 264 data blocks and end-of-file marker
+            assert_eq!(stats.blocks_inflated, 265);
+            assert_eq!(stats.cache_misses, 265);
+            assert_eq!(stats.cache_hits, 0);
+            assert_eq!(stats.cache_evictions, 265 - 10);
+            assert_eq!(stats.compressed_bytes, data.len() as u64);
+            assert_eq!(stats.uncompressed_bytes, expected.len() as u64);
+            assert_eq!(stats.seeks, 0);
+
+            reader.bgzf_seek(0)?;
+            reader.bgzf_seek(4210818610)?;
+            reader.bgzf_seek(0)?;
+            reader.fill_buf()?;
+            let stats = reader.stats();
+            assert_eq!(stats.seeks, 3);
+            assert_eq!(stats.cache_misses, 267);
+            assert_eq!(stats.cache_hits, 1);
+            assert!(stats.blocks_inflated >= 267);
+        }
+        Ok(())
+    }
 }
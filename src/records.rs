@@ -0,0 +1,166 @@
+use crate::*;
+use std::io::{self, BufRead};
+
+/// Reader of newline separated records which borrows records from block buffers.
+///
+/// Unlike [`BufRead::read_line`], a record is not copied or validated as UTF-8. A record within one
+/// buffer of the underlying reader, such as an inflated block of [`BGZFReader`], is returned as a slice
+/// of the buffer. Only a record across buffers is joined into a scratch buffer, which is reused.
+/// Records do not include the line terminator `\n`.
+/// ```
+/// use bgzip::{BGZFReader, RecordReader};
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let reader = BGZFReader::new(std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+/// let mut records = RecordReader::new(reader);
+/// let mut count = 0;
+/// while let Some(record) = records.next_record()? {
+///     if !record.starts_with(b"#") {
+///         count += 1;
+///     }
+/// }
+/// assert_eq!(count, 66114);
+/// # Ok(())
+/// # }
+/// ```
+pub struct RecordReader<R: BufRead> {
+    reader: R,
+    scratch: Vec<u8>,
+    /// Length of the last record in the buffer of `reader`, which is consumed at the next call
+    pending: usize,
+}
+
+impl<R: BufRead> RecordReader<R> {
+    /// Create a new record reader from std::io::BufRead, such as [`BGZFReader`]
+    pub fn new(reader: R) -> Self {
+        RecordReader {
+            reader,
+            scratch: Vec::new(),
+            pending: 0,
+        }
+    }
+
+    /// Read the next record. Returns `None` at end of file.
+    pub fn next_record(&mut self) -> io::Result<Option<&[u8]>> {
+        self.consume_pending();
+        let buf = self.reader.fill_buf()?;
+        if buf.is_empty() {
+            return Ok(None);
+        }
+        if let Some(i) = memchr::memchr(b'\n', buf) {
+            self.pending = i + 1;
+            // fill_buf returns the same buffer without reading again
+            return Ok(Some(&self.reader.fill_buf()?[..i]));
+        }
+
+        self.scratch.clear();
+        loop {
+            let buf = self.reader.fill_buf()?;
+            if buf.is_empty() {
+                break;
+            }
+            if let Some(i) = memchr::memchr(b'\n', buf) {
+                self.scratch.extend_from_slice(&buf[..i]);
+                self.reader.consume(i + 1);
+                break;
+            }
+            let length = buf.len();
+            self.scratch.extend_from_slice(buf);
+            self.reader.consume(length);
+        }
+        Ok(Some(&self.scratch))
+    }
+
+    pub fn get_ref(&self) -> &R {
+        &self.reader
+    }
+
+    /// Get the underlying reader, positioned after the last returned record.
+    pub fn get_mut(&mut self) -> &mut R {
+        self.consume_pending();
+        &mut self.reader
+    }
+
+    /// Unwrap the underlying reader, positioned after the last returned record.
+    pub fn into_inner(mut self) -> R {
+        self.consume_pending();
+        self.reader
+    }
+
+    fn consume_pending(&mut self) {
+        if self.pending > 0 {
+            self.reader.consume(self.pending);
+            self.pending = 0;
+        }
+    }
+}
+
+impl<R: BGZFRead> RecordReader<R> {
+    /// Get BGZF virtual file offset of the next record.
+    pub fn bgzf_pos(&mut self) -> u64 {
+        self.consume_pending();
+        self.reader.bgzf_pos()
+    }
+
+    /// Seek BGZF with virtual file offset. The next record starts at `position`.
+    pub fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        self.pending = 0;
+        self.reader.bgzf_seek(position)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs;
+    use std::io::{Read, Write};
+
+    #[test]
+    fn test_records() -> Result<(), BGZFError> {
+        let mut expected_data = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?)
+        .read_to_end(&mut expected_data)?;
+        let expected: Vec<&[u8]> = expected_data[..expected_data.len() - 1]
+            .split(|x| *x == b'\n')
+            .collect();
+        assert_eq!(expected.len(), 66171);
+
+        for threads in [1, 3].iter() {
+            let reader = BGZFReader::with_threads(
+                fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?,
+                *threads,
+            );
+            let mut records = RecordReader::new(reader);
+            for one in expected.iter() {
+                assert_eq!(records.next_record()?, Some(*one));
+            }
+            assert_eq!(records.next_record()?, None);
+        }
+
+        // Small blocks to join most records across blocks
+        let mut data = Vec::new();
+        let mut writer = BGZFWriter::new(&mut data, flate2::Compression::fast());
+        writer.set_block_size(100)?;
+        writer.write_all(b"\n\n")?;
+        writer.write_all(&[b'a'; 450])?;
+        writer.write_all(b"\nbc\n\nlast")?;
+        writer.close()?;
+        let mut records = RecordReader::new(BGZFReader::new(io::Cursor::new(&data)));
+        assert_eq!(records.next_record()?, Some(&b""[..]));
+        assert_eq!(records.next_record()?, Some(&b""[..]));
+        assert_eq!(records.next_record()?, Some(&[b'a'; 450][..]));
+        let position = records.bgzf_pos();
+        assert_eq!(records.next_record()?, Some(&b"bc"[..]));
+        assert_eq!(records.next_record()?, Some(&b""[..]));
+        assert_eq!(records.next_record()?, Some(&b"last"[..]));
+        assert_eq!(records.next_record()?, None);
+
+        records.bgzf_seek(position)?;
+        assert_eq!(records.next_record()?, Some(&b"bc"[..]));
+        let mut rest = Vec::new();
+        records.get_mut().read_to_end(&mut rest)?;
+        assert_eq!(rest, b"\nlast");
+        Ok(())
+    }
+}
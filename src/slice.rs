@@ -0,0 +1,217 @@
+use crate::cache::{BGZFCache, BlockCache, SharedBlockCache};
+use crate::codec::DeflateCodec;
+use crate::header::{fixed_header_block_size, BGZFHeader, BGZF_HEADER_SIZE};
+use crate::read::BlockDecompressor;
+use crate::*;
+use std::io::{self, BufRead, Read};
+
+/// Loads blocks from a byte slice.
+struct SliceSource<T: AsRef<[u8]>> {
+    data: T,
+    decompressor: BlockDecompressor,
+    shared_cache: Option<(SharedBlockCache, u64)>,
+}
+
+impl<T: AsRef<[u8]>> SliceSource<T> {
+    fn load_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some((shared_cache, file_id)) = self.shared_cache.clone() {
+            shared_cache.load(file_id, cache, block_position, |cache, position| {
+                self.inflate_block(cache, position)
+            })
+        } else {
+            self.inflate_block(cache, block_position)
+        }
+    }
+
+    fn inflate_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        let data = self.data.as_ref();
+        if block_position >= data.len() as u64 {
+            return Ok(None);
+        }
+        let block_start = block_position as usize;
+        let (header_size, block_size) =
+            find_block(&data[block_start..])?.ok_or(BGZFError::Other {
+                message: "Invalid block size",
+            })?;
+        let buffer = cache.take_buffer();
+        Ok(Some(self.decompressor.decompress(
+            block_position,
+            (block_start + block_size) as u64,
+            &data[(block_start + header_size)..(block_start + block_size)],
+            buffer,
+        )?))
+    }
+}
+
+/// Find header size and total size of a block at the beginning of `data`.
+/// Returns `None` if `data` does not contain the whole block.
+pub(crate) fn find_block(data: &[u8]) -> Result<Option<(usize, usize)>, BGZFError> {
+    let (header_size, block_size) = if let Some(block_size) = fixed_header_block_size(data) {
+        (BGZF_HEADER_SIZE, block_size)
+    } else {
+        let mut header_bytes = data;
+        let header = match BGZFHeader::from_reader(&mut header_bytes) {
+            Ok(header) => header,
+            Err(BGZFError::IoError(e)) if e.kind() == io::ErrorKind::UnexpectedEof => {
+                return Ok(None)
+            }
+            Err(e) => return Err(e),
+        };
+        (
+            header.header_size() as usize,
+            header.block_size()? as usize + 1,
+        )
+    };
+    if block_size < header_size + 8 {
+        return Err(BGZFError::Other {
+            message: "Invalid block size",
+        });
+    }
+    if block_size > data.len() {
+        return Ok(None);
+    }
+    Ok(Some((header_size, block_size)))
+}
+
+/// A BGZF reader for data on memory
+///
+/// Headers are parsed and blocks are inflated directly from the slice without copying compressed data.
+/// With a memory-mapped file (e.g. `memmap2::Mmap`), seek requires no system call.
+pub struct BGZFSliceReader<T: AsRef<[u8]>> {
+    source: SliceSource<T>,
+    cache: BlockCache,
+}
+
+impl<T: AsRef<[u8]>> BGZFSliceReader<T> {
+    /// Create a new BGZF reader from a byte slice, such as `Vec<u8>`, `&[u8]` or a memory-mapped file.
+    pub fn new(data: T) -> Self {
+        BGZFSliceReader {
+            source: SliceSource {
+                data,
+                decompressor: BlockDecompressor::new(),
+                shared_cache: None,
+            },
+            cache: BlockCache::new(),
+        }
+    }
+
+    /// Set maximum number of inflated blocks kept in the cache, including the current block.
+    ///
+    /// The least recently used block is evicted first. Default limit is 10 blocks.
+    pub fn set_cache_limit(&mut self, blocks: usize) {
+        self.cache.set_limit(blocks);
+    }
+
+    /// Set maximum total size of inflated blocks kept in the cache in bytes.
+    ///
+    /// The current block is always kept even if it exceeds the limit. No limit by default.
+    pub fn set_cache_byte_limit(&mut self, bytes: usize) {
+        self.cache.set_byte_limit(bytes);
+    }
+
+    /// Seek BGZF with virtual file offset. See [`BGZFReader::bgzf_seek`](crate::BGZFReader::bgzf_seek).
+    pub fn bgzf_seek(&mut self, position: u64) -> Result<(), BGZFError> {
+        let source = &mut self.source;
+        self.cache
+            .seek(position, |cache, block| source.load_block(cache, block))
+    }
+
+    /// Get BGZF virtual file offset. See [`BGZFReader::bgzf_pos`](crate::BGZFReader::bgzf_pos).
+    pub fn bgzf_pos(&self) -> u64 {
+        self.cache.position()
+    }
+
+    /// Inflate blocks with `codec` instead of the default [`Flate2Codec`](crate::Flate2Codec).
+    pub fn set_codec(&mut self, codec: &dyn DeflateCodec) {
+        self.source.decompressor.set_codec(codec);
+    }
+
+    /// Enable or disable CRC32 verification. See [`BGZFReader::set_verify_crc`](crate::BGZFReader::set_verify_crc).
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.source.decompressor.set_verify_crc(verify);
+    }
+
+    /// Share inflated blocks with other readers. See [`BGZFReader::set_shared_cache`](crate::BGZFReader::set_shared_cache).
+    pub fn set_shared_cache(&mut self, cache: SharedBlockCache, file_id: u64) {
+        self.source.shared_cache = Some((cache, file_id));
+    }
+
+    /// Get a reference to underlying data.
+    pub fn get_ref(&self) -> &T {
+        &self.source.data
+    }
+}
+
+impl<T: AsRef<[u8]>> BufRead for BGZFSliceReader<T> {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        let source = &mut self.source;
+        self.cache
+            .fill_buf(|cache, block| source.load_block(cache, block))
+    }
+
+    fn consume(&mut self, amt: usize) {
+        self.cache.consume(amt)
+    }
+}
+
+impl<T: AsRef<[u8]>> Read for BGZFSliceReader<T> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let source = &mut self.source;
+        self.cache
+            .read(buf, |cache, block| source.load_block(cache, block))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs;
+
+    #[test]
+    fn test_slice_read() -> Result<(), BGZFError> {
+        let data = fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut reader = BGZFSliceReader::new(&data[..]);
+        let mut expected_reader = io::BufReader::new(flate2::read::MultiGzDecoder::new(&data[..]));
+
+        let mut line1 = String::new();
+        let mut line2 = String::new();
+        loop {
+            line1.clear();
+            line2.clear();
+            let read_len1 = reader.read_line(&mut line1)?;
+            let read_len2 = expected_reader.read_line(&mut line2)?;
+            assert_eq!(line1, line2);
+            if read_len1 == 0 {
+                assert_eq!(read_len2, 0);
+                break;
+            }
+        }
+
+        let mut reader = BGZFSliceReader::new(data);
+        let mut buffer: [u8; 8] = [0; 8];
+        reader.bgzf_seek(35973)?;
+        assert_eq!(reader.bgzf_pos(), 35973);
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"1\t"));
+        reader.bgzf_seek(135183301012)?;
+        assert_eq!(reader.bgzf_pos(), 135183301012);
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"11\t"));
+        reader.bgzf_seek(4210818610)?;
+        reader.read_exact(&mut buffer)?;
+        assert!(buffer.starts_with(b"1\t"));
+
+        let truncated = &reader.get_ref()[..1000];
+        let mut reader = BGZFSliceReader::new(truncated);
+        assert!(reader.read(&mut buffer).is_err());
+        Ok(())
+    }
+}
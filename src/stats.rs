@@ -0,0 +1,66 @@
+use std::time::Duration;
+
+/// Counters of a BGZF reader. Returned by [`BGZFReader::stats`](crate::BGZFReader::stats).
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ReaderStats {
+    /// Number of blocks inflated by this reader
+    pub blocks_inflated: u64,
+    /// Number of block switches served from the block cache
+    pub cache_hits: u64,
+    /// Number of blocks loaded because they were not in the block cache
+    pub cache_misses: u64,
+    /// Number of blocks evicted from the block cache
+    pub cache_evictions: u64,
+    /// Size of inflated blocks in the file, including headers and footers
+    pub compressed_bytes: u64,
+    /// Size of data inflated from blocks
+    pub uncompressed_bytes: u64,
+    /// Number of calls of `bgzf_seek`
+    pub seeks: u64,
+    /// Time spent in the deflate codec. With read-ahead threads, time of all threads is summed.
+    pub codec_time: Duration,
+    /// Time spent in reading the underlying reader
+    pub io_time: Duration,
+}
+
+/// Counters of a BGZF writer. Returned by [`BGZFWriter::stats`](crate::BGZFWriter::stats).
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct WriterStats {
+    /// Number of blocks written, excluding the end-of-file marker
+    pub blocks_deflated: u64,
+    /// Size of written blocks
+    pub compressed_bytes: u64,
+    /// Size of data in written blocks
+    pub uncompressed_bytes: u64,
+    /// Time spent in the deflate codec. With worker threads, time of all threads is summed.
+    pub codec_time: Duration,
+    /// Time spent in writing the underlying writer
+    pub io_time: Duration,
+}
+
+/// Counters of block lookups in `BlockCache`
+#[derive(Debug, Clone, Copy, Default)]
+pub(crate) struct CacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    pub evictions: u64,
+    pub seeks: u64,
+}
+
+/// Counters of `BlockDecompressor`
+#[derive(Debug, Clone, Copy, Default)]
+pub(crate) struct InflateStats {
+    pub blocks: u64,
+    pub compressed_bytes: u64,
+    pub uncompressed_bytes: u64,
+    pub time: Duration,
+}
+
+impl InflateStats {
+    pub fn add(&mut self, other: &InflateStats) {
+        self.blocks += other.blocks;
+        self.compressed_bytes += other.compressed_bytes;
+        self.uncompressed_bytes += other.uncompressed_bytes;
+        self.time += other.time;
+    }
+}
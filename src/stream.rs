@@ -0,0 +1,303 @@
+use crate::cache::{BGZFCache, BlockCache};
+use crate::codec::{DeflateCodec, Flate2Codec};
+use crate::read::{read_raw_block, BlockDecompressor, RawBlock, ReadAhead};
+use crate::stats::ReaderStats;
+use crate::*;
+use std::io::{self, BufRead, Read};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// Loads blocks from non-seekable reader in order.
+struct StreamSource<R: Read> {
+    reader: io::BufReader<R>,
+    /// Compressed file offset of the next block read from `reader`
+    reader_position: u64,
+    /// Compressed file offset of the next block returned to the cache
+    next_position: u64,
+    read_ahead: Option<ReadAhead>,
+    /// An error of `reader` while reading blocks in advance
+    read_ahead_error: Option<BGZFError>,
+    /// Kind and message of the first error returned, which is returned again by following calls
+    /// because the stream cannot be read again from the failed block
+    error: Option<(io::ErrorKind, String)>,
+    decompressor: BlockDecompressor,
+    io_time: Duration,
+}
+
+impl<R: Read> StreamSource<R> {
+    fn load_block(
+        &mut self,
+        cache: &mut BlockCache,
+        block_position: u64,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some((kind, message)) = self.error.as_ref() {
+            return Err(io::Error::new(*kind, message.clone()).into());
+        }
+        if block_position != self.next_position {
+            return Err(BGZFError::Other {
+                message: "Stream reader cannot seek",
+            });
+        }
+        let result = if let Some(mut read_ahead) = self.read_ahead.take() {
+            let result = self.load_block_with_read_ahead(cache, &mut read_ahead);
+            self.read_ahead = Some(read_ahead);
+            result
+        } else {
+            self.load_block_without_read_ahead(cache)
+        };
+        match result.as_ref() {
+            Ok(Some(block)) => self.next_position = block.next_position,
+            Ok(None) => (),
+            Err(BGZFError::IoError(e)) => self.error = Some((e.kind(), e.to_string())),
+            Err(e) => self.error = Some((io::ErrorKind::InvalidData, e.to_string())),
+        }
+        result
+    }
+
+    fn load_block_without_read_ahead(
+        &mut self,
+        cache: &mut BlockCache,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        if let Some(raw) = self.read_raw_block(cache)? {
+            let buffer = cache.take_buffer();
+            let result =
+                self.decompressor
+                    .decompress(raw.position, raw.next_position, &raw.data, buffer);
+            cache.recycle_buffer(raw.data);
+            Ok(Some(result?))
+        } else {
+            Ok(None)
+        }
+    }
+
+    fn load_block_with_read_ahead(
+        &mut self,
+        cache: &mut BlockCache,
+        read_ahead: &mut ReadAhead,
+    ) -> Result<Option<BGZFCache>, BGZFError> {
+        self.fill_read_ahead(cache, read_ahead);
+        if read_ahead.positions.pop_front().is_some() {
+            let (raw, result, stats) = read_ahead.workers.recv().unwrap();
+            read_ahead.stats.add(&stats);
+            cache.recycle_buffer(raw);
+            self.fill_read_ahead(cache, read_ahead);
+            return result.map(Some);
+        }
+        // All blocks read in advance are returned
+        match self.read_ahead_error.take() {
+            Some(e) => Err(e),
+            None => Ok(None),
+        }
+    }
+
+    fn fill_read_ahead(&mut self, cache: &mut BlockCache, read_ahead: &mut ReadAhead) {
+        while !read_ahead.stopped
+            && read_ahead.workers.in_flight() < read_ahead.workers.threads() * 2
+        {
+            match self.read_raw_block(cache) {
+                Ok(Some(raw)) => {
+                    read_ahead.positions.push_back(raw.position);
+                    let buffer = cache.take_buffer();
+                    read_ahead
+                        .workers
+                        .submit((raw, buffer, self.decompressor.verify_crc()));
+                }
+                Ok(None) => read_ahead.stopped = true,
+                Err(e) => {
+                    read_ahead.stopped = true;
+                    self.read_ahead_error = Some(e);
+                }
+            }
+        }
+    }
+
+    fn read_raw_block(&mut self, cache: &mut BlockCache) -> Result<Option<RawBlock>, BGZFError> {
+        let start = Instant::now();
+        let result = read_raw_block(&mut self.reader, self.reader_position, cache.take_buffer());
+        self.io_time += start.elapsed();
+        if let Ok(Some(raw)) = result.as_ref() {
+            self.reader_position = raw.next_position;
+        }
+        result
+    }
+}
+
+/// A forward-only BGZF reader for non-seekable input, such as standard input or a socket.
+///
+/// Blocks are inflated in order, and only the current block is kept. [`BGZFStreamReader::bgzf_pos`]
+/// reports virtual file offsets counted from the beginning of the stream, for example to build an index
+/// while reading a pipe.
+/// ```
+/// use bgzip::BGZFStreamReader;
+/// use std::io::BufRead;
+/// # fn main() -> Result<(), bgzip::BGZFError> {
+/// let file = std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+/// let mut reader = BGZFStreamReader::with_threads(file, 4);
+/// let mut line = String::new();
+/// reader.read_line(&mut line)?;
+/// assert_eq!(line, "##fileformat=VCFv4.0\n");
+/// assert_eq!(reader.bgzf_pos(), 21);
+/// assert_eq!(reader.lines().count(), 66170);
+/// # Ok(())
+/// # }
+/// ```
+pub struct BGZFStreamReader<R: Read> {
+    source: StreamSource<R>,
+    cache: BlockCache,
+}
+
+impl<R: Read> BGZFStreamReader<R> {
+    /// Create a new BGZF reader from std::io::Read
+    pub fn new(reader: R) -> Self {
+        BGZFStreamReader::with_buf_reader(io::BufReader::new(reader))
+    }
+
+    /// Create a new BGZF reader from std::io::BufReader
+    pub fn with_buf_reader(reader: io::BufReader<R>) -> Self {
+        let mut cache = BlockCache::new();
+        cache.set_limit(1);
+        BGZFStreamReader {
+            source: StreamSource {
+                reader,
+                reader_position: 0,
+                next_position: 0,
+                read_ahead: None,
+                read_ahead_error: None,
+                error: None,
+                decompressor: BlockDecompressor::new(),
+                io_time: Duration::default(),
+            },
+            cache,
+        }
+    }
+
+    /// Create a new BGZF reader with parallel read-ahead.
+    ///
+    /// `threads` worker threads inflate following blocks in advance. At most `threads * 2` blocks are read ahead.
+    pub fn with_threads(reader: R, threads: usize) -> Self {
+        BGZFStreamReader::with_codec(reader, threads, Arc::new(Flate2Codec))
+    }
+
+    /// Create a new BGZF reader which inflates blocks with `codec`.
+    ///
+    /// See [`BGZFStreamReader::with_threads`] for `threads`.
+    pub fn with_codec(reader: R, threads: usize, codec: Arc<dyn DeflateCodec>) -> Self {
+        let mut bgzf_reader = BGZFStreamReader::new(reader);
+        bgzf_reader.source.decompressor.set_codec(&*codec);
+        if threads > 1 {
+            bgzf_reader.source.read_ahead = Some(ReadAhead::new(threads, codec));
+        }
+        bgzf_reader
+    }
+
+    /// Enable or disable CRC32 verification of inflated blocks. Enabled by default.
+    ///
+    /// See [`BGZFReader::set_verify_crc`].
+    pub fn set_verify_crc(&mut self, verify: bool) {
+        self.source.decompressor.set_verify_crc(verify);
+    }
+
+    /// Counters of this reader. See [`BGZFReader::stats`].
+    pub fn stats(&self) -> ReaderStats {
+        let mut inflate = self.source.decompressor.stats();
+        if let Some(read_ahead) = self.source.read_ahead.as_ref() {
+            inflate.add(&read_ahead.stats);
+        }
+        let cache = self.cache.stats();
+        ReaderStats {
+            blocks_inflated: inflate.blocks,
+            cache_hits: cache.hits,
+            cache_misses: cache.misses,
+            cache_evictions: cache.evictions,
+            compressed_bytes: inflate.compressed_bytes,
+            uncompressed_bytes: inflate.uncompressed_bytes,
+            seeks: cache.seeks,
+            codec_time: inflate.time,
+            io_time: self.source.io_time,
+        }
+    }
+
+    /// Get BGZF virtual file offset of read position, counted from the beginning of the stream.
+    pub fn bgzf_pos(&self) -> u64 {
+        self.cache.position()
+    }
+}
+
+impl<R: Read> BufRead for BGZFStreamReader<R> {
+    fn fill_buf(&mut self) -> io::Result<&[u8]> {
+        let source = &mut self.source;
+        self.cache
+            .fill_buf(|cache, block| source.load_block(cache, block))
+    }
+
+    fn consume(&mut self, amt: usize) {
+        self.cache.consume(amt)
+    }
+}
+
+impl<R: Read> Read for BGZFStreamReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let source = &mut self.source;
+        self.cache
+            .read(buf, |cache, block| source.load_block(cache, block))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs;
+
+    /// A reader which returns at most 1000 bytes per call like a pipe
+    struct Pipe<'a>(&'a [u8]);
+
+    impl<'a> Read for Pipe<'a> {
+        fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+            let length = buf.len().min(self.0.len()).min(1000);
+            buf[..length].copy_from_slice(&self.0[..length]);
+            self.0 = &self.0[length..];
+            Ok(length)
+        }
+    }
+
+    #[test]
+    fn test_stream_reader() -> Result<(), BGZFError> {
+        let compressed = fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&compressed[..]).read_to_end(&mut expected)?;
+        let mut seekable = crate::BGZFSliceReader::new(&compressed[..]);
+
+        for threads in [1, 3].iter() {
+            let mut reader = BGZFStreamReader::with_threads(Pipe(&compressed), *threads);
+            seekable.bgzf_seek(0)?;
+            let mut data = Vec::new();
+            let mut line = Vec::new();
+            loop {
+                assert_eq!(reader.bgzf_pos(), seekable.bgzf_pos());
+                line.clear();
+                if reader.read_until(b'\n', &mut line)? == 0 {
+                    break;
+                }
+                seekable.read_until(b'\n', &mut Vec::new())?;
+                data.extend_from_slice(&line);
+            }
+            assert_eq!(data, expected);
+
+            let stats = reader.stats();
+            assert_eq!(stats.blocks_inflated, 265);
+            assert_eq!(stats.compressed_bytes, compressed.len() as u64);
+            assert_eq!(stats.uncompressed_bytes, expected.len() as u64);
+            assert!(reader.cache.cached_bytes() <= 65536);
+        }
+
+        for threads in [1, 3].iter() {
+            let mut reader = BGZFStreamReader::with_threads(&compressed[..100_000], *threads);
+            let error = io::copy(&mut reader, &mut io::sink()).unwrap_err();
+            // Truncated data is not reported as end of file by retrying
+            for _ in 0..2 {
+                assert_eq!(reader.fill_buf().unwrap_err().kind(), error.kind());
+            }
+        }
+        Ok(())
+    }
+}
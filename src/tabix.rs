@@ -1,8 +1,13 @@
+use crate::read::{BlockBatches, BlockDecompressor};
+use crate::slice::find_block;
+use crate::worker::OrderedWorkers;
+use crate::write::FOOTER_BYTES;
 use crate::*;
 use std::collections::HashMap;
 use std::convert::TryInto;
 use std::i32;
-use std::io::{self, BufRead, Read, Result};
+use std::io::{self, BufRead, Read, Result, Write};
+use std::sync::Arc;
 
 #[derive(Debug, Clone, PartialEq)]
 pub struct TabixChunk {
@@ -16,18 +21,27 @@ impl TabixChunk {
         let end = reader.read_le_u64()?;
         Ok(TabixChunk { begin, end })
     }
+
+    fn write_to(&self, output: &mut Vec<u8>) {
+        output.extend_from_slice(&self.begin.to_le_bytes());
+        output.extend_from_slice(&self.end.to_le_bytes());
+    }
 }
 
 #[derive(Debug, Clone, PartialEq)]
 pub struct TabixBin {
     pub bin: u32,
+    /// Smallest virtual file offset of records overlapping with this bin and later bins.
+    /// Only CSI index has this value, and it is zero in TBI index.
+    pub loffset: u64,
     pub number_of_chunk: i32,
     pub chunks: Vec<TabixChunk>,
 }
 
 impl TabixBin {
-    fn from_reader<R: Read + BinaryReader>(reader: &mut R) -> Result<Self> {
+    fn from_reader<R: Read + BinaryReader>(reader: &mut R, csi: bool) -> Result<Self> {
         let bin = reader.read_le_u32()?;
+        let loffset = if csi { reader.read_le_u64()? } else { 0 };
         let number_of_chunk = reader.read_le_i32()?;
         let mut chunks = Vec::new();
         for _ in 0..number_of_chunk {
@@ -36,10 +50,22 @@ impl TabixBin {
 
         Ok(TabixBin {
             bin,
+            loffset,
             number_of_chunk,
             chunks,
         })
     }
+
+    fn write_to(&self, output: &mut Vec<u8>, csi: bool) {
+        output.extend_from_slice(&self.bin.to_le_bytes());
+        if csi {
+            output.extend_from_slice(&self.loffset.to_le_bytes());
+        }
+        output.extend_from_slice(&(self.chunks.len() as i32).to_le_bytes());
+        for one in &self.chunks {
+            one.write_to(output);
+        }
+    }
 }
 
 #[derive(Debug, Clone, PartialEq)]
@@ -51,15 +77,16 @@ pub struct TabixSequence {
 }
 
 impl TabixSequence {
-    fn from_reader<R: Read + BinaryReader>(reader: &mut R) -> Result<Self> {
+    fn from_reader<R: Read + BinaryReader>(reader: &mut R, csi: bool) -> Result<Self> {
         let number_of_distinct_bin = reader.read_le_i32()?;
         let mut bins = HashMap::new();
         for _ in 0..number_of_distinct_bin {
-            let one_bin = TabixBin::from_reader(reader)?;
+            let one_bin = TabixBin::from_reader(reader, csi)?;
             bins.insert(one_bin.bin, one_bin);
         }
 
-        let number_of_intervals = reader.read_le_i32()?;
+        // CSI index has no linear index
+        let number_of_intervals = if csi { 0 } else { reader.read_le_i32()? };
 
         let mut intervals = Vec::new();
         for _ in 0..number_of_intervals {
@@ -72,10 +99,121 @@ impl TabixSequence {
             intervals,
         })
     }
+
+    fn write_to(&self, output: &mut Vec<u8>, csi: bool) {
+        let mut bins: Vec<_> = self.bins.values().collect();
+        bins.sort_by_key(|x| x.bin);
+        output.extend_from_slice(&(bins.len() as i32).to_le_bytes());
+        for one in bins {
+            one.write_to(output, csi);
+        }
+        if !csi {
+            output.extend_from_slice(&(self.intervals.len() as i32).to_le_bytes());
+            for one in &self.intervals {
+                output.extend_from_slice(&one.to_le_bytes());
+            }
+        }
+    }
+
+    /// Get merged and sorted chunks which may contain records overlapping with region [begin, end) (zero-based).
+    pub fn query(&self, begin: i64, end: i64, min_shift: i32, depth: i32) -> Vec<TabixChunk> {
+        let begin = begin.max(0);
+        if begin >= end {
+            return Vec::new();
+        }
+        let min_offset = min_offset(&self.intervals, begin, min_shift, depth, |x| {
+            self.bins.get(&x).map(|x| x.loffset)
+        });
+
+        let chunks = reg2bins(begin, end, min_shift, depth)
+            .into_iter()
+            .filter_map(|x| self.bins.get(&x))
+            .flat_map(|x| x.chunks.iter())
+            .filter(|x| x.end > min_offset)
+            .cloned()
+            .collect();
+        merge_chunks(chunks)
+    }
+}
+
+/// Smallest virtual file offset of records which may overlap with `begin` or later positions.
+///
+/// The linear index is used if available. Otherwise `loffset` of the nearest bin at left or upper level
+/// is used, as htslib does for CSI index.
+fn min_offset<F: Fn(u32) -> Option<u64>>(
+    intervals: &[u64],
+    begin: i64,
+    min_shift: i32,
+    depth: i32,
+    loffset: F,
+) -> u64 {
+    if !intervals.is_empty() {
+        let index = ((begin >> min_shift) as usize).min(intervals.len() - 1);
+        return intervals[index];
+    }
+
+    let mut bin = reg2bin(begin, begin + 1, min_shift, depth) as u32;
+    loop {
+        if let Some(x) = loffset(bin) {
+            return x;
+        }
+        if bin == 0 {
+            return 0;
+        }
+        let parent = (bin - 1) >> 3;
+        if bin > (parent << 3) + 1 {
+            bin -= 1;
+        } else {
+            bin = parent;
+        }
+    }
+}
+
+/// Sort chunks and merge overlapping chunks, or adjacent chunks in the same BGZF block.
+pub fn merge_chunks(mut chunks: Vec<TabixChunk>) -> Vec<TabixChunk> {
+    chunks.sort_by_key(|x| x.begin);
+    let mut merged: Vec<TabixChunk> = Vec::with_capacity(chunks.len());
+    for one in chunks {
+        if let Some(last) = merged.last_mut() {
+            if one.begin <= last.end || one.begin >> 16 == last.end >> 16 {
+                last.end = last.end.max(one.end);
+                continue;
+            }
+        }
+        merged.push(one);
+    }
+    merged
+}
+
+/// `min_shift` of TBI index
+pub const TABIX_MIN_SHIFT: i32 = 14;
+/// `depth` of TBI index
+pub const TABIX_DEPTH: i32 = 5;
+
+/// Generic tab-delimited format
+pub const FORMAT_GENERIC: i32 = 0;
+/// SAM format
+pub const FORMAT_SAM: i32 = 1;
+/// VCF format
+pub const FORMAT_VCF: i32 = 2;
+/// Flag for zero-based, half-open coordinates (UCSC BED style)
+pub const FORMAT_FLAG_ZERO_BASED: i32 = 0x10000;
+
+/// Zero-based, half-open interval of a record
+#[derive(Debug, Clone, PartialEq)]
+pub struct TabixRecordPosition<'a> {
+    pub sequence: &'a [u8],
+    pub begin: i64,
+    pub end: i64,
 }
 
+/// TBI or CSI index of a BGZF compressed tab-delimited file
 #[derive(Debug, Clone, PartialEq)]
 pub struct Tabix {
+    /// Size of the smallest bin is `1 << min_shift`. TBI index always uses 14.
+    pub min_shift: i32,
+    /// Number of bin levels except the root bin. TBI index always uses 5.
+    pub depth: i32,
     pub number_of_references: i32,
     pub format: i32,
     pub column_for_sequence: i32,
@@ -88,46 +226,595 @@ pub struct Tabix {
     pub sequences: Vec<TabixSequence>,
 }
 
+/// Size of tabix header fields in CSI index except sequence names
+const TABIX_HEADER_SIZE: usize = 28;
+
 impl Tabix {
+    /// Load TBI or CSI index. The format is detected from the magic number.
+    ///
+    /// Header fields of CSI index without tabix meta data (e.g. CSI index of BAM file) are filled with zero.
     pub fn from_reader(reader: &mut impl Read) -> Result<Self> {
         let mut reader = io::BufReader::new(flate2::read::MultiGzDecoder::new(reader));
+        let (mut tabix, csi) = Tabix::read_index_header(&mut reader)?;
+        for _ in 0..tabix.number_of_references {
+            tabix
+                .sequences
+                .push(TabixSequence::from_reader(&mut reader, csi)?);
+        }
+
+        Ok(tabix)
+    }
 
+    /// Read fields before sequences and detect format. Returns index without sequences and `true` for CSI.
+    fn read_index_header<R: Read + BinaryReader>(reader: &mut R) -> Result<(Tabix, bool)> {
         let mut buf: [u8; 4] = [0, 0, 0, 0];
         reader.read_exact(&mut buf)?;
-        if buf != [b'T', b'B', b'I', 1] {
-            return Err(io::Error::new(io::ErrorKind::Other, "Not Tabix format"));
-        }
-        let number_of_references = reader.read_le_i32()?;
-        let format = reader.read_le_i32()?;
-        let column_for_sequence = reader.read_le_i32()?;
-        let column_for_begin = reader.read_le_i32()?;
-        let column_for_end = reader.read_le_i32()?;
-        reader.read_exact(&mut buf)?;
-        let meta = buf;
-        let skip = reader.read_le_i32()?;
-        let length_of_concatenated_sequence_names = reader.read_le_i32()?;
-        let mut name_bytes: Vec<u8> =
-            vec![0; length_of_concatenated_sequence_names.try_into().unwrap()];
+        let csi = match &buf {
+            b"TBI\x01" => false,
+            b"CSI\x01" => true,
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::Other,
+                    "Not Tabix or CSI format",
+                ))
+            }
+        };
+
+        let mut tabix = Tabix {
+            min_shift: TABIX_MIN_SHIFT,
+            depth: TABIX_DEPTH,
+            number_of_references: 0,
+            format: FORMAT_GENERIC,
+            column_for_sequence: 0,
+            column_for_begin: 0,
+            column_for_end: 0,
+            meta: [0; 4],
+            skip: 0,
+            length_of_concatenated_sequence_names: 0,
+            names: Vec::new(),
+            sequences: Vec::new(),
+        };
+
+        if csi {
+            tabix.min_shift = reader.read_le_i32()?;
+            tabix.depth = reader.read_le_i32()?;
+            if !(1..=31).contains(&tabix.min_shift)
+                || !(1..=10).contains(&tabix.depth)
+                || tabix.min_shift + tabix.depth * 3 > 62
+            {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "Invalid min_shift or depth",
+                ));
+            }
+            let length_of_aux = reader.read_le_i32()?;
+            let mut aux = vec![0; length_of_aux.try_into().map_err(invalid_length)?];
+            reader.read_exact(&mut aux)?;
+            if aux.len() >= TABIX_HEADER_SIZE {
+                tabix.read_header(&mut &aux[..])?;
+            }
+            tabix.number_of_references = reader.read_le_i32()?;
+        } else {
+            tabix.number_of_references = reader.read_le_i32()?;
+            tabix.read_header(reader)?;
+        }
+        if tabix.number_of_references < 0 {
+            return Err(invalid_length(()));
+        }
+
+        Ok((tabix, csi))
+    }
+
+    fn read_header<R: Read + BinaryReader>(&mut self, reader: &mut R) -> Result<()> {
+        self.format = reader.read_le_i32()?;
+        self.column_for_sequence = reader.read_le_i32()?;
+        self.column_for_begin = reader.read_le_i32()?;
+        self.column_for_end = reader.read_le_i32()?;
+        reader.read_exact(&mut self.meta)?;
+        self.skip = reader.read_le_i32()?;
+        self.length_of_concatenated_sequence_names = reader.read_le_i32()?;
+        let mut name_bytes: Vec<u8> = vec![
+            0;
+            self.length_of_concatenated_sequence_names
+                .try_into()
+                .map_err(invalid_length)?
+        ];
         reader.read_exact(&mut name_bytes)?;
-        let names = split_names(&name_bytes);
-
-        let mut sequences = Vec::new();
-        for _ in 0..number_of_references {
-            sequences.push(TabixSequence::from_reader(&mut reader)?);
-        }
-
-        Ok(Tabix {
-            number_of_references,
-            format,
-            column_for_sequence,
-            column_for_begin,
-            column_for_end,
-            meta,
-            skip,
-            length_of_concatenated_sequence_names,
-            names,
+        self.names = split_names(&name_bytes);
+        Ok(())
+    }
+
+    fn write_header(&self, output: &mut Vec<u8>) {
+        let names: Vec<u8> = self.names.concat();
+        for one in &[
+            self.format,
+            self.column_for_sequence,
+            self.column_for_begin,
+            self.column_for_end,
+        ] {
+            output.extend_from_slice(&one.to_le_bytes());
+        }
+        output.extend_from_slice(&self.meta);
+        output.extend_from_slice(&self.skip.to_le_bytes());
+        output.extend_from_slice(&(names.len() as i32).to_le_bytes());
+        output.extend_from_slice(&names);
+    }
+
+    /// Write BGZF compressed TBI index.
+    ///
+    /// Returns an error if `min_shift` and `depth` of this index are not supported by TBI format.
+    pub fn write_tbi<W: Write>(&self, writer: W) -> Result<()> {
+        if self.min_shift != TABIX_MIN_SHIFT || self.depth != TABIX_DEPTH {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "TBI index requires min_shift 14 and depth 5",
+            ));
+        }
+        let mut data = b"TBI\x01".to_vec();
+        data.extend_from_slice(&(self.sequences.len() as i32).to_le_bytes());
+        self.write_header(&mut data);
+        for one in &self.sequences {
+            one.write_to(&mut data, false);
+        }
+        write_compressed(writer, &data)
+    }
+
+    /// Write BGZF compressed CSI index with tabix meta data.
+    pub fn write_csi<W: Write>(&self, writer: W) -> Result<()> {
+        let mut aux = Vec::new();
+        self.write_header(&mut aux);
+        let mut data = b"CSI\x01".to_vec();
+        data.extend_from_slice(&self.min_shift.to_le_bytes());
+        data.extend_from_slice(&self.depth.to_le_bytes());
+        data.extend_from_slice(&(aux.len() as i32).to_le_bytes());
+        data.extend_from_slice(&aux);
+        data.extend_from_slice(&(self.sequences.len() as i32).to_le_bytes());
+        for one in &self.sequences {
+            one.write_to(&mut data, true);
+        }
+        write_compressed(writer, &data)
+    }
+}
+
+fn invalid_length<E>(_: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, "Invalid length")
+}
+
+fn write_compressed<W: Write>(writer: W, data: &[u8]) -> Result<()> {
+    let mut writer = BGZFWriter::new(writer, flate2::Compression::default());
+    writer.write_all(data)?;
+    writer.close()
+}
+
+impl Tabix {
+    /// Check a record range for binning of this index. Returns [begin, end) clamped to a valid interval.
+    fn record_range(&self, begin: i64, end: i64) -> Result<(i64, i64)> {
+        let begin = begin.max(0);
+        let end = end.max(begin + 1);
+        if end > 1i64 << (self.min_shift + self.depth * 3) {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "Position is too large for binning of the index",
+            ));
+        }
+        Ok((begin, end))
+    }
+
+    /// Find index of a sequence by name
+    pub fn sequence_id(&self, name: &[u8]) -> Option<usize> {
+        self.names
+            .iter()
+            .position(|x| x.strip_suffix(&[0]).unwrap_or(x) == name)
+    }
+
+    /// Name of a sequence without trailing NUL character
+    pub fn sequence_name(&self, sequence_id: usize) -> Option<&[u8]> {
+        self.names
+            .get(sequence_id)
+            .map(|x| x.strip_suffix(&[0]).unwrap_or(x))
+    }
+
+    /// Get merged and sorted chunks which may contain records overlapping with region [begin, end) (zero-based).
+    pub fn query(&self, sequence_id: usize, begin: i64, end: i64) -> Vec<TabixChunk> {
+        self.sequences
+            .get(sequence_id)
+            .map(|x| x.query(begin, end, self.min_shift, self.depth))
+            .unwrap_or_default()
+    }
+
+    /// Split lines of the indexed file into `n` ranges of about the same compressed size.
+    ///
+    /// Unlike [`partition`](crate::partition), the file is not read. Range boundaries are taken from
+    /// beginnings of records in chunks and the linear index. `compressed_size` is the size of the indexed file.
+    /// The first range begins at 0 to include header lines.
+    pub fn partition(&self, compressed_size: u64, n: usize) -> Vec<TabixChunk> {
+        // Bins after the last bin are pseudo-bins of htslib, which store counts in chunks
+        let bin_limit = (((1u64 << ((self.depth + 1) * 3)) - 1) / 7) as u32;
+        let mut offsets: Vec<u64> = self
+            .sequences
+            .iter()
+            .flat_map(|x| {
+                x.bins
+                    .values()
+                    .filter(|x| x.bin < bin_limit)
+                    .flat_map(|x| x.chunks.iter().map(|x| x.begin))
+                    .chain(x.intervals.iter().copied())
+            })
+            .collect();
+        offsets.sort_unstable();
+        offsets.dedup();
+
+        let end = compressed_size << 16;
+        let n = n.max(1);
+        let mut begins = vec![0];
+        for i in 1..n {
+            let target = (compressed_size as u128 * i as u128 / n as u128) as u64;
+            let index = offsets.partition_point(|x| x >> 16 < target);
+            let begin = offsets.get(index).copied().unwrap_or(end);
+            begins.push(begin.max(*begins.last().unwrap()));
+        }
+        begins.push(end);
+        begins
+            .windows(2)
+            .map(|x| TabixChunk {
+                begin: x[0],
+                end: x[1],
+            })
+            .collect()
+    }
+
+    /// Get records overlapping with region [begin, end) (zero-based) of the sequence.
+    pub fn query_records<'a, R: BGZFRead>(
+        &'a self,
+        reader: &'a mut R,
+        sequence_id: usize,
+        begin: i64,
+        end: i64,
+    ) -> TabixRecords<'a, R> {
+        TabixRecords {
+            tabix: self,
+            reader,
+            chunks: ChunkCursor::new(self.query(sequence_id, begin, end)),
+            sequence_name: self.sequence_name(sequence_id).unwrap_or(b""),
+            begin,
+            end,
+            finished: false,
+            line: Vec::new(),
+        }
+    }
+
+    /// Get records overlapping with any of `regions`.
+    ///
+    /// Chunks of all regions are merged and read in file order, so a block shared by nearby regions is
+    /// read and inflated only once, instead of once for each region. Each item is an index of `regions` and a record
+    /// overlapping with the region. A record overlapping with two or more regions is returned for each region.
+    /// Regions do not have to be sorted. With [`BGZFReader::with_threads`](crate::BGZFReader::with_threads),
+    /// following blocks are inflated in parallel while records are read.
+    pub fn query_regions<'a, R: BGZFRead>(
+        &'a self,
+        reader: &'a mut R,
+        regions: &[TabixRegion],
+    ) -> TabixBatchRecords<'a, R> {
+        let mut chunks = Vec::new();
+        let mut sequences: Vec<BatchSequence> = Vec::new();
+        for (index, region) in regions.iter().enumerate() {
+            if region.begin >= region.end {
+                continue;
+            }
+            let name = match self.sequence_name(region.sequence_id) {
+                Some(name) => name,
+                None => continue,
+            };
+            chunks.extend(self.query(region.sequence_id, region.begin, region.end));
+            let sequence = if let Some(x) = sequences.iter_mut().position(|x| x.name == name) {
+                &mut sequences[x]
+            } else {
+                sequences.push(BatchSequence {
+                    name,
+                    regions: Vec::new(),
+                    max_end: Vec::new(),
+                });
+                sequences.last_mut().unwrap()
+            };
+            sequence.regions.push((region.begin, region.end, index));
+        }
+        for one in sequences.iter_mut() {
+            one.regions.sort_unstable();
+            let mut max_end = i64::MIN;
+            one.max_end = one
+                .regions
+                .iter()
+                .map(|x| {
+                    max_end = max_end.max(x.1);
+                    max_end
+                })
+                .collect();
+        }
+
+        TabixBatchRecords {
+            tabix: self,
+            reader,
+            chunks: ChunkCursor::new(merge_chunks(chunks)),
             sequences,
-        })
+            last_sequence: 0,
+            matched: Vec::new(),
+            line: Vec::new(),
+            finished: false,
+        }
+    }
+
+    /// Parse sequence name, begin and end position of a record with columns and format of this index.
+    /// Returns `None` for meta lines.
+    pub fn record_position<'a>(&self, line: &'a [u8]) -> Result<Option<TabixRecordPosition<'a>>> {
+        if line.is_empty() || (self.meta[0] != 0 && line[0] == self.meta[0]) {
+            return Ok(None);
+        }
+
+        let format = self.format & 0xffff;
+        let mut sequence = None;
+        let mut begin = None;
+        let mut end = None;
+        for (i, column) in line.split(|x| *x == b'\t').enumerate() {
+            let column_index = i as i32 + 1;
+            if column_index == self.column_for_sequence {
+                sequence = Some(column);
+            }
+            if column_index == self.column_for_begin {
+                begin = Some(parse_position(column)?);
+            }
+            if column_index == self.column_for_end && format == FORMAT_GENERIC {
+                end = Some(parse_position(column)?);
+            }
+            match (format, column_index) {
+                (FORMAT_VCF, 4) => {
+                    end = begin.map(|x| x - 1 + column.len() as i64);
+                }
+                (FORMAT_VCF, 8) => {
+                    for one in column.split(|x| *x == b';') {
+                        if let Some(value) = one.strip_prefix(b"END=") {
+                            end = Some(parse_position(value)?);
+                        }
+                    }
+                }
+                (FORMAT_SAM, 6) => {
+                    end = begin.map(|x| x - 1 + cigar_reference_length(column).max(1));
+                }
+                _ => (),
+            }
+        }
+
+        let (sequence, begin) = match (sequence, begin) {
+            (Some(sequence), Some(begin)) => (sequence, begin),
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "Too few columns in a record",
+                ))
+            }
+        };
+        let begin = if self.format & FORMAT_FLAG_ZERO_BASED != 0 {
+            begin
+        } else {
+            begin - 1
+        };
+        let end = end.unwrap_or(begin + 1).max(begin + 1);
+
+        Ok(Some(TabixRecordPosition {
+            sequence,
+            begin,
+            end,
+        }))
+    }
+}
+
+fn parse_position(data: &[u8]) -> Result<i64> {
+    std::str::from_utf8(data)
+        .ok()
+        .and_then(|x| x.parse().ok())
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "Invalid position"))
+}
+
+fn cigar_reference_length(cigar: &[u8]) -> i64 {
+    let mut length = 0;
+    let mut number = 0;
+    for one in cigar {
+        match one {
+            b'0'..=b'9' => number = number * 10 + i64::from(one - b'0'),
+            b'M' | b'D' | b'N' | b'=' | b'X' => {
+                length += number;
+                number = 0;
+            }
+            _ => number = 0,
+        }
+    }
+    length
+}
+
+/// Reads lines within chunks in order.
+struct ChunkCursor {
+    chunks: Vec<TabixChunk>,
+    next_chunk: usize,
+    current_chunk_end: u64,
+    /// Whether chunks are prefetched and the reader is positioned at the first chunk
+    started: bool,
+}
+
+impl ChunkCursor {
+    fn new(chunks: Vec<TabixChunk>) -> Self {
+        ChunkCursor {
+            chunks,
+            next_chunk: 0,
+            current_chunk_end: 0,
+            started: false,
+        }
+    }
+
+    /// Read the next line without a newline into `line`. Returns `false` after the last chunk.
+    fn read_line<R: BGZFRead>(&mut self, reader: &mut R, line: &mut Vec<u8>) -> Result<bool> {
+        if !self.started || reader.bgzf_pos() >= self.current_chunk_end {
+            let chunk = if let Some(chunk) = self.chunks.get(self.next_chunk) {
+                chunk.clone()
+            } else {
+                return Ok(false);
+            };
+            self.next_chunk += 1;
+            // The reader may be left anywhere by a previous query, so always seek to the first chunk.
+            // A following chunk is usually reached by reading the previous one.
+            let position = reader.bgzf_pos();
+            if !self.started || position < chunk.begin || chunk.end <= position {
+                if !self.started {
+                    self.started = true;
+                    reader.prefetch(&self.chunks).map_err(to_io)?;
+                }
+                reader.bgzf_seek(chunk.begin).map_err(to_io)?;
+            }
+            self.current_chunk_end = chunk.end;
+        }
+
+        line.clear();
+        if reader.read_until(b'\n', line)? == 0 {
+            return Ok(false);
+        }
+        if line.ends_with(b"\n") {
+            line.pop();
+        }
+        Ok(true)
+    }
+}
+
+/// An iterator over records overlapping with a region. Each record is returned without a newline.
+///
+/// This struct is created by [`Tabix::query_records`].
+pub struct TabixRecords<'a, R: BGZFRead> {
+    tabix: &'a Tabix,
+    reader: &'a mut R,
+    chunks: ChunkCursor,
+    sequence_name: &'a [u8],
+    begin: i64,
+    end: i64,
+    finished: bool,
+    line: Vec<u8>,
+}
+
+impl<'a, R: BGZFRead> TabixRecords<'a, R> {
+    fn next_record(&mut self) -> Result<Option<Vec<u8>>> {
+        while !self.finished && self.chunks.read_line(self.reader, &mut self.line)? {
+            if let Some(position) = self.tabix.record_position(&self.line)? {
+                if position.sequence != self.sequence_name || position.end <= self.begin {
+                    continue;
+                }
+                if self.end <= position.begin {
+                    break;
+                }
+                return Ok(Some(self.line.clone()));
+            }
+        }
+        self.finished = true;
+        Ok(None)
+    }
+}
+
+impl<'a, R: BGZFRead> Iterator for TabixRecords<'a, R> {
+    type Item = Result<Vec<u8>>;
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_record().transpose()
+    }
+}
+
+/// A zero-based, half-open region of a sequence for [`Tabix::query_regions`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TabixRegion {
+    pub sequence_id: usize,
+    pub begin: i64,
+    pub end: i64,
+}
+
+impl TabixRegion {
+    pub fn new(sequence_id: usize, begin: i64, end: i64) -> Self {
+        TabixRegion {
+            sequence_id,
+            begin,
+            end,
+        }
+    }
+}
+
+/// Queried regions of a sequence
+struct BatchSequence<'a> {
+    name: &'a [u8],
+    /// Begin, end and index of regions sorted by begin
+    regions: Vec<(i64, i64, usize)>,
+    /// Maximum end of regions up to each region
+    max_end: Vec<i64>,
+}
+
+impl<'a> BatchSequence<'a> {
+    /// Add indexes of regions overlapping with [begin, end) to `matched`.
+    fn find_overlaps(&self, begin: i64, end: i64, matched: &mut Vec<usize>) {
+        let mut i = self.regions.partition_point(|x| x.0 < end);
+        while i > 0 && self.max_end[i - 1] > begin {
+            i -= 1;
+            if self.regions[i].1 > begin {
+                matched.push(self.regions[i].2);
+            }
+        }
+    }
+}
+
+/// An iterator over records overlapping with regions. Each item is an index of a region and a record without a newline.
+///
+/// This struct is created by [`Tabix::query_regions`].
+pub struct TabixBatchRecords<'a, R: BGZFRead> {
+    tabix: &'a Tabix,
+    reader: &'a mut R,
+    chunks: ChunkCursor,
+    sequences: Vec<BatchSequence<'a>>,
+    last_sequence: usize,
+    /// Regions overlapping with the current record, in reverse order
+    matched: Vec<usize>,
+    line: Vec<u8>,
+    finished: bool,
+}
+
+impl<'a, R: BGZFRead> TabixBatchRecords<'a, R> {
+    fn next_record(&mut self) -> Result<Option<(usize, Vec<u8>)>> {
+        if let Some(index) = self.matched.pop() {
+            return Ok(Some((index, self.line.clone())));
+        }
+        while !self.finished && self.chunks.read_line(self.reader, &mut self.line)? {
+            if let Some(position) = self.tabix.record_position(&self.line)? {
+                if self.sequences.get(self.last_sequence).map(|x| x.name) != Some(position.sequence)
+                {
+                    match self
+                        .sequences
+                        .iter()
+                        .position(|x| x.name == position.sequence)
+                    {
+                        Some(x) => self.last_sequence = x,
+                        None => continue,
+                    }
+                }
+                self.sequences[self.last_sequence].find_overlaps(
+                    position.begin,
+                    position.end,
+                    &mut self.matched,
+                );
+                if !self.matched.is_empty() {
+                    self.matched.sort_unstable_by(|x, y| y.cmp(x));
+                    let index = self.matched.pop().unwrap();
+                    return Ok(Some((index, self.line.clone())));
+                }
+            }
+        }
+        self.finished = true;
+        Ok(None)
+    }
+}
+
+impl<'a, R: BGZFRead> Iterator for TabixBatchRecords<'a, R> {
+    type Item = Result<(usize, Vec<u8>)>;
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_record().transpose()
     }
 }
 
@@ -164,16 +851,914 @@ pub fn reg2bin(beg: i64, end: i64, min_shift: i32, depth: i32) -> i32 {
     }
     0
 }
-// /* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
-// int reg2bins(int64_t beg, int64_t end, int min_shift, int depth, int *bins)
-// {
-// int l, t, n, s = min_shift + depth*3;
-// for (--end, l = n = t = 0; l <= depth; s -= 3, t += 1<<l*3, ++l) {
-// int b = t + (beg>>s), e = t + (end>>s), i;
-// for (i = b; i <= e; ++i) bins[n++] = i;
-// }
-// return n;
-//}
+/* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
+pub fn reg2bins(beg: i64, end: i64, min_shift: i32, depth: i32) -> Vec<u32> {
+    let mut bins = Vec::new();
+    let mut s = min_shift + depth * 3;
+    if beg >= end {
+        return bins;
+    }
+    let end = end.min(1 << s) - 1;
+    let mut t = 0;
+    for l in 0..=depth {
+        let b = t + (beg >> s);
+        let e = t + (end >> s);
+        for i in b..=e {
+            bins.push(i as u32);
+        }
+        s -= 3;
+        t += 1 << (l * 3);
+    }
+    bins
+}
+
+/// Smallest `depth` whose bins can address sequences of `max_length` with `min_shift`
+pub fn binning_depth(min_shift: i32, max_length: i64) -> i32 {
+    let mut depth = 1;
+    while depth < 10 && (1i64 << (min_shift + depth * 3)) < max_length {
+        depth += 1;
+    }
+    depth
+}
+
+/// Index of the first linear index window covered by the bin
+fn bin_first_window(bin: u32, depth: i32) -> usize {
+    let mut level = 0;
+    let mut first = 0;
+    while level < depth && bin >= first + (1 << (level * 3)) {
+        first += 1 << (level * 3);
+        level += 1;
+    }
+    ((bin - first) as usize) << ((depth - level) * 3)
+}
+
+struct BuildingSequence {
+    last_begin: i64,
+    bins: HashMap<u32, TabixBin>,
+    intervals: Vec<u64>,
+    current: Option<(u32, TabixChunk)>,
+}
+
+impl BuildingSequence {
+    fn new() -> Self {
+        BuildingSequence {
+            last_begin: 0,
+            bins: HashMap::new(),
+            intervals: Vec::new(),
+            current: None,
+        }
+    }
+
+    fn save_chunk(&mut self) {
+        if let Some((bin, chunk)) = self.current.take() {
+            let chunks = &mut self
+                .bins
+                .entry(bin)
+                .or_insert_with(|| TabixBin {
+                    bin,
+                    loffset: 0,
+                    number_of_chunk: 0,
+                    chunks: Vec::new(),
+                })
+                .chunks;
+            match chunks.last_mut() {
+                // chunks in the same BGZF block are read together anyway
+                Some(last) if last.end >> 16 == chunk.begin >> 16 => last.end = chunk.end,
+                _ => chunks.push(chunk),
+            }
+        }
+    }
+
+    /// Add a chunk of records in `bin`. Consecutive chunks in the same bin are joined.
+    fn add_run(&mut self, bin: u32, chunk: TabixChunk) {
+        match &mut self.current {
+            Some((current_bin, current)) if *current_bin == bin => current.end = chunk.end,
+            _ => {
+                self.save_chunk();
+                self.current = Some((bin, chunk));
+            }
+        }
+    }
+
+    fn finish(mut self, depth: i32) -> TabixSequence {
+        self.save_chunk();
+        let mut previous = 0;
+        for one in self.intervals.iter_mut() {
+            if *one == u64::MAX {
+                *one = previous;
+            }
+            previous = *one;
+        }
+        for one in self.bins.values_mut() {
+            one.number_of_chunk = one.chunks.len() as i32;
+            one.loffset = self
+                .intervals
+                .get(bin_first_window(one.bin, depth))
+                .copied()
+                .unwrap_or(0);
+        }
+        TabixSequence {
+            number_of_distinct_bin: self.bins.len() as i32,
+            bins: self.bins,
+            number_of_intervals: self.intervals.len() as i32,
+            intervals: self.intervals,
+        }
+    }
+}
+
+fn unsorted() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidInput, "Records are not sorted")
+}
+
+/// Set the first chunk of linear index windows overlapping with [begin, end) if they are unset.
+fn add_interval(intervals: &mut Vec<u64>, begin: i64, end: i64, chunk_begin: u64, min_shift: i32) {
+    let last_window = ((end - 1) >> min_shift) as usize;
+    if intervals.len() <= last_window {
+        intervals.resize(last_window + 1, u64::MAX);
+    }
+    for one in &mut intervals[(begin >> min_shift) as usize..=last_window] {
+        if *one == u64::MAX {
+            *one = chunk_begin;
+        }
+    }
+}
+
+/// Build TBI or CSI index from records sorted by position.
+///
+/// Records of a sequence must be contiguous, and sorted by begin position.
+/// ```
+/// use bgzip::tabix::TabixBuilder;
+/// # fn main() -> std::io::Result<()> {
+/// let mut builder = TabixBuilder::vcf();
+/// builder.add_line(b"#CHROM\tPOS\tID\tREF\tALT", 0, 0)?;
+/// builder.add_line(b"1\t100\t.\tA\tT", 0, 20)?;
+/// builder.add_line(b"1\t200\t.\tAC\tT", 20, 40)?;
+/// let tabix = builder.finish();
+/// assert_eq!(tabix.query(0, 150, 151).len(), 1);
+/// # Ok(())
+/// # }
+/// ```
+pub struct TabixBuilder {
+    tabix: Tabix,
+    current: Option<BuildingSequence>,
+    lines: usize,
+}
+
+impl TabixBuilder {
+    /// Create a builder of index for records with the given format and columns (one-based).
+    pub fn new(
+        format: i32,
+        column_for_sequence: i32,
+        column_for_begin: i32,
+        column_for_end: i32,
+        meta: u8,
+        skip: i32,
+    ) -> Self {
+        TabixBuilder {
+            tabix: Tabix {
+                min_shift: TABIX_MIN_SHIFT,
+                depth: TABIX_DEPTH,
+                number_of_references: 0,
+                format,
+                column_for_sequence,
+                column_for_begin,
+                column_for_end,
+                meta: [meta, 0, 0, 0],
+                skip,
+                length_of_concatenated_sequence_names: 0,
+                names: Vec::new(),
+                sequences: Vec::new(),
+            },
+            current: None,
+            lines: 0,
+        }
+    }
+
+    /// Create a builder of index for VCF
+    pub fn vcf() -> Self {
+        TabixBuilder::new(FORMAT_VCF, 1, 2, 0, b'#', 0)
+    }
+
+    /// Create a builder of index for BED
+    pub fn bed() -> Self {
+        TabixBuilder::new(FORMAT_GENERIC | FORMAT_FLAG_ZERO_BASED, 1, 2, 3, b'#', 0)
+    }
+
+    /// Change binning of index. This must be called before adding records.
+    ///
+    /// A built index with other than `min_shift` 14 and `depth` 5 can be written only as CSI.
+    /// Use [`binning_depth`] to find `depth` for long sequences.
+    pub fn set_binning(&mut self, min_shift: i32, depth: i32) {
+        self.tabix.min_shift = min_shift;
+        self.tabix.depth = depth;
+    }
+
+    /// Add a line without newline. `chunk_begin` and `chunk_end` are virtual file offsets of the line.
+    /// Meta lines and skipped lines at the beginning are ignored.
+    pub fn add_line(&mut self, line: &[u8], chunk_begin: u64, chunk_end: u64) -> Result<()> {
+        if let Some(position) = self.parse_line(line)? {
+            self.add_record(
+                position.sequence,
+                position.begin,
+                position.end,
+                chunk_begin,
+                chunk_end,
+            )?;
+        }
+        Ok(())
+    }
+
+    /// Parse position of a line. Returns `None` for meta lines and skipped lines at the beginning.
+    fn parse_line<'a>(&mut self, line: &'a [u8]) -> Result<Option<TabixRecordPosition<'a>>> {
+        self.lines += 1;
+        if self.lines <= self.tabix.skip.max(0) as usize {
+            return Ok(None);
+        }
+        self.tabix.record_position(line)
+    }
+
+    /// Add a record overlapping with region [begin, end) (zero-based).
+    pub fn add_record(
+        &mut self,
+        sequence: &[u8],
+        begin: i64,
+        end: i64,
+        chunk_begin: u64,
+        chunk_end: u64,
+    ) -> Result<()> {
+        let (begin, end) = self.tabix.record_range(begin, end)?;
+        let min_shift = self.tabix.min_shift;
+        let bin = reg2bin(begin, end, min_shift, self.tabix.depth) as u32;
+        let current = self.sequence(sequence)?;
+        if begin < current.last_begin {
+            return Err(unsorted());
+        }
+        current.last_begin = begin;
+        add_interval(&mut current.intervals, begin, end, chunk_begin, min_shift);
+        current.add_run(
+            bin,
+            TabixChunk {
+                begin: chunk_begin,
+                end: chunk_end,
+            },
+        );
+        Ok(())
+    }
+
+    /// Get the sequence to add records of `sequence`. A new sequence is started if it is not the last one.
+    fn sequence(&mut self, sequence: &[u8]) -> Result<&mut BuildingSequence> {
+        if self
+            .tabix
+            .sequence_name(self.tabix.names.len().wrapping_sub(1))
+            != Some(sequence)
+        {
+            if self.tabix.sequence_id(sequence).is_some() {
+                return Err(unsorted());
+            }
+            self.finish_sequence();
+            let mut name = sequence.to_vec();
+            name.push(0);
+            self.tabix.names.push(name);
+            self.current = Some(BuildingSequence::new());
+        }
+        Ok(self.current.as_mut().unwrap())
+    }
+
+    /// Add records of a shard indexed by a worker of [`TabixBuilder::build_parallel`].
+    fn add_shard_sequence(&mut self, shard: ShardSequence) -> Result<()> {
+        let current = self.sequence(&shard.name)?;
+        if shard.first_begin < current.last_begin {
+            return Err(unsorted());
+        }
+        current.last_begin = shard.last_begin;
+        if current.intervals.len() < shard.intervals.len() {
+            current.intervals.resize(shard.intervals.len(), u64::MAX);
+        }
+        for (one, shard_one) in current.intervals.iter_mut().zip(shard.intervals) {
+            if *one == u64::MAX {
+                *one = shard_one;
+            }
+        }
+        for (bin, chunk) in shard.runs {
+            current.add_run(bin, chunk);
+        }
+        Ok(())
+    }
+
+    fn finish_sequence(&mut self) {
+        if let Some(current) = self.current.take() {
+            self.tabix.sequences.push(current.finish(self.tabix.depth));
+        }
+    }
+
+    /// Finish building and return the index.
+    pub fn finish(mut self) -> Tabix {
+        self.finish_sequence();
+        self.tabix.number_of_references = self.tabix.sequences.len() as i32;
+        self.tabix.length_of_concatenated_sequence_names =
+            self.tabix.names.iter().map(|x| x.len() as i32).sum();
+        self.tabix
+    }
+
+    /// Build index of whole BGZF compressed data from `reader` with `threads` worker threads.
+    ///
+    /// Data is split into shards at block boundaries found from block headers. Each worker inflates
+    /// a shard and computes bins and linear index of its records, and the results are merged in order.
+    /// Lines across shards are added by the calling thread. This must be called with a new builder.
+    /// ```
+    /// use bgzip::tabix::{Tabix, TabixBuilder};
+    /// # fn main() -> std::io::Result<()> {
+    /// let file = std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+    /// let tabix = TabixBuilder::vcf().build_parallel(file, 4)?;
+    /// let mut data = Vec::new();
+    /// tabix.write_tbi(&mut data)?;
+    /// let loaded = Tabix::from_reader(&mut &data[..])?;
+    /// assert_eq!(loaded.names, tabix.names);
+    /// assert_eq!(loaded.query(0, 1_000_000, 2_000_000), tabix.query(0, 1_000_000, 2_000_000));
+    /// # Ok(())
+    /// # }
+    /// ```
+    pub fn build_parallel<R: Read>(mut self, reader: R, threads: usize) -> Result<Tabix> {
+        if self.lines > 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "Records are already added",
+            ));
+        }
+        let header = Arc::new(self.tabix.clone());
+        let mut workers = OrderedWorkers::new(threads, move || {
+            let header = header.clone();
+            let mut decompressor = BlockDecompressor::new();
+            move |(position, raw, skip): (u64, Vec<u8>, usize)| {
+                index_shard(&header, &mut decompressor, position, &raw, skip)
+            }
+        });
+        let skip = self.tabix.skip.max(0) as usize;
+        let mut batches = BlockBatches::new(reader);
+        // The last line of shards merged so far, which is not terminated yet
+        let mut pending = Vec::new();
+        let mut pending_begin = 0;
+
+        loop {
+            while !batches.is_finished() && workers.in_flight() < workers.threads() * 2 {
+                let (position, raw) = match batches.next_batch(Vec::new()).map_err(to_io)? {
+                    Some(batch) => batch,
+                    None => break,
+                };
+                // Only the first shard contains skipped lines except the first line
+                let shard_skip = if position == 0 {
+                    skip.saturating_sub(1)
+                } else {
+                    0
+                };
+                workers.submit((position, raw, shard_skip));
+            }
+
+            let shard = match workers.recv() {
+                Some(shard) => shard?,
+                None => break,
+            };
+            pending.extend_from_slice(&shard.head);
+            if let Some(head_end) = shard.head_end {
+                self.add_line(&pending, pending_begin, head_end)?;
+                if shard.skipped < skip.saturating_sub(self.lines).min(shard.lines) {
+                    return Err(io::Error::new(
+                        io::ErrorKind::InvalidInput,
+                        "Too many skipped lines for parallel build",
+                    ));
+                }
+                self.lines += shard.lines;
+                for one in shard.sequences {
+                    self.add_shard_sequence(one)?;
+                }
+                pending = shard.tail;
+                pending_begin = shard.tail_begin;
+            }
+        }
+        if !pending.is_empty() {
+            self.add_line(&pending, pending_begin, batches.position() << 16)?;
+        }
+        Ok(self.finish())
+    }
+}
+
+fn to_io(e: BGZFError) -> io::Error {
+    match e {
+        BGZFError::IoError(e) => e,
+        e => io::Error::new(io::ErrorKind::InvalidData, e),
+    }
+}
+
+/// Records of a sequence in a shard
+struct ShardSequence {
+    name: Vec<u8>,
+    first_begin: i64,
+    last_begin: i64,
+    /// Chunks of consecutive records in the same bin
+    runs: Vec<(u32, TabixChunk)>,
+    /// Linear index. Unset windows are `u64::MAX`.
+    intervals: Vec<u64>,
+}
+
+/// Result of a shard of `TabixBuilder::build_parallel`
+struct ShardIndex {
+    /// Data before the first newline, which continues the last line of the previous shard
+    head: Vec<u8>,
+    /// Virtual file offset after the first newline. `None` if the shard has no newline.
+    head_end: Option<u64>,
+    /// Data after the last newline and its virtual file offset
+    tail: Vec<u8>,
+    tail_begin: u64,
+    /// Number of lines between the first and the last newline
+    lines: usize,
+    /// Number of lines ignored as skipped lines
+    skipped: usize,
+    sequences: Vec<ShardSequence>,
+}
+
+/// Inflate blocks in `raw` starting at compressed file offset `position`, and index lines in them.
+fn index_shard(
+    header: &Tabix,
+    decompressor: &mut BlockDecompressor,
+    position: u64,
+    raw: &[u8],
+    skip: usize,
+) -> Result<ShardIndex> {
+    let mut data = Vec::new();
+    // Offset in `data` and compressed file offset of each block
+    let mut blocks = Vec::new();
+    let mut block_position = position;
+    let mut rest = raw;
+    while let Some((_, block_size)) = find_block(rest).map_err(to_io)? {
+        blocks.push((data.len(), block_position));
+        decompressor
+            .decompress_blocks(&rest[..block_size], &mut data)
+            .map_err(to_io)?;
+        block_position += block_size as u64;
+        rest = &rest[block_size..];
+    }
+
+    // Virtual file offset after `offset` (> 0) bytes of `data`, same as `bgzf_pos` of readers.
+    // The end of a block is the beginning of the next block.
+    let virtual_offset = |offset: usize| {
+        let i = blocks.partition_point(|x| x.0 < offset) - 1;
+        let (next_offset, next_position) = blocks
+            .get(i + 1)
+            .copied()
+            .unwrap_or((data.len(), block_position));
+        if offset == next_offset {
+            next_position << 16
+        } else {
+            blocks[i].1 << 16 | (offset - blocks[i].0) as u64
+        }
+    };
+
+    let first = match memchr::memchr(b'\n', &data) {
+        Some(first) => first,
+        None => {
+            return Ok(ShardIndex {
+                head: data,
+                head_end: None,
+                tail: Vec::new(),
+                tail_begin: 0,
+                lines: 0,
+                skipped: 0,
+                sequences: Vec::new(),
+            })
+        }
+    };
+    let last = memchr::memrchr(b'\n', &data).unwrap();
+    let mut shard = ShardIndex {
+        head: data[..first].to_vec(),
+        head_end: Some(virtual_offset(first + 1)),
+        tail: data[(last + 1)..].to_vec(),
+        tail_begin: virtual_offset(last + 1),
+        lines: 0,
+        skipped: 0,
+        sequences: Vec::new(),
+    };
+
+    let mut line_begin = first + 1;
+    let mut chunk_begin = shard.head_end.unwrap();
+    for line_end in memchr::memchr_iter(b'\n', &data[(first + 1)..=last]) {
+        let line_end = first + 1 + line_end;
+        let chunk_end = virtual_offset(line_end + 1);
+        shard.lines += 1;
+        if shard.lines <= skip {
+            shard.skipped += 1;
+        } else if let Some(record) = header.record_position(&data[line_begin..line_end])? {
+            let (begin, end) = header.record_range(record.begin, record.end)?;
+            let sequence = match shard.sequences.last_mut() {
+                Some(one) if one.name == record.sequence => one,
+                _ => {
+                    shard.sequences.push(ShardSequence {
+                        name: record.sequence.to_vec(),
+                        first_begin: begin,
+                        last_begin: begin,
+                        runs: Vec::new(),
+                        intervals: Vec::new(),
+                    });
+                    shard.sequences.last_mut().unwrap()
+                }
+            };
+            if begin < sequence.last_begin {
+                return Err(unsorted());
+            }
+            sequence.last_begin = begin;
+            add_interval(
+                &mut sequence.intervals,
+                begin,
+                end,
+                chunk_begin,
+                header.min_shift,
+            );
+            let bin = reg2bin(begin, end, header.min_shift, header.depth) as u32;
+            match sequence.runs.last_mut() {
+                Some((last_bin, chunk)) if *last_bin == bin => chunk.end = chunk_end,
+                _ => sequence.runs.push((
+                    bin,
+                    TabixChunk {
+                        begin: chunk_begin,
+                        end: chunk_end,
+                    },
+                )),
+            }
+        }
+        line_begin = line_end + 1;
+        chunk_begin = chunk_end;
+    }
+    Ok(shard)
+}
+
+/// A bin of [`CompactSequence`] referring a range of the shared chunk array
+#[derive(Debug, Clone, PartialEq)]
+struct CompactBin {
+    bin: u32,
+    loffset: u64,
+    chunk_begin: u32,
+    chunk_end: u32,
+}
+
+/// Bins and linear index of a sequence in flattened layout.
+///
+/// Chunks of all bins are stored in one array, and bins are sorted by bin number for binary search.
+#[derive(Debug, Clone, PartialEq, Default)]
+pub struct CompactSequence {
+    bins: Vec<CompactBin>,
+    chunks: Vec<TabixChunk>,
+    intervals: Vec<u64>,
+}
+
+impl CompactSequence {
+    /// Decode a sequence of TBI or CSI index.
+    fn from_bytes(data: &[u8], csi: bool) -> Result<Self> {
+        let mut reader = data;
+        let number_of_bins = read_count(&mut reader)?;
+        let mut sequence = CompactSequence {
+            bins: Vec::with_capacity(number_of_bins),
+            chunks: Vec::new(),
+            intervals: Vec::new(),
+        };
+        for _ in 0..number_of_bins {
+            let bin = reader.read_le_u32()?;
+            let loffset = if csi { reader.read_le_u64()? } else { 0 };
+            let number_of_chunks = read_count(&mut reader)?;
+            let chunk_begin = sequence.chunks.len() as u32;
+            for _ in 0..number_of_chunks {
+                sequence.chunks.push(TabixChunk::from_reader(&mut reader)?);
+            }
+            sequence.bins.push(CompactBin {
+                bin,
+                loffset,
+                chunk_begin,
+                chunk_end: sequence.chunks.len() as u32,
+            });
+        }
+        sequence.bins.sort_by_key(|x| x.bin);
+        if !csi {
+            let number_of_intervals = read_count(&mut reader)?;
+            sequence.intervals.reserve(number_of_intervals);
+            for _ in 0..number_of_intervals {
+                sequence.intervals.push(reader.read_le_u64()?);
+            }
+        }
+        Ok(sequence)
+    }
+
+    /// Length in bytes of a sequence at the beginning of `data`.
+    fn encoded_length(data: &[u8], csi: bool) -> Result<usize> {
+        let mut reader = data;
+        let number_of_bins = read_count(&mut reader)?;
+        let bin_header_size = if csi { 16 } else { 8 };
+        for _ in 0..number_of_bins {
+            if reader.len() < bin_header_size {
+                return Err(truncated());
+            }
+            reader = &reader[(bin_header_size - 4)..];
+            let chunks_size = read_count(&mut reader)? * 16;
+            reader = reader.get(chunks_size..).ok_or_else(truncated)?;
+        }
+        if !csi {
+            let intervals_size = read_count(&mut reader)? * 8;
+            reader = reader.get(intervals_size..).ok_or_else(truncated)?;
+        }
+        Ok(data.len() - reader.len())
+    }
+
+    fn find_bin(&self, bin: u32) -> Option<&CompactBin> {
+        self.bins
+            .binary_search_by_key(&bin, |x| x.bin)
+            .ok()
+            .map(|x| &self.bins[x])
+    }
+
+    /// Chunks of a bin
+    pub fn bin_chunks(&self, bin: u32) -> Option<&[TabixChunk]> {
+        self.find_bin(bin)
+            .map(|x| &self.chunks[(x.chunk_begin as usize)..(x.chunk_end as usize)])
+    }
+
+    /// Linear index. CSI index has no linear index.
+    pub fn intervals(&self) -> &[u64] {
+        &self.intervals
+    }
+
+    /// Get merged and sorted chunks which may contain records overlapping with region [begin, end) (zero-based).
+    pub fn query(&self, begin: i64, end: i64, min_shift: i32, depth: i32) -> Vec<TabixChunk> {
+        let begin = begin.max(0);
+        if begin >= end {
+            return Vec::new();
+        }
+        let min_offset = min_offset(&self.intervals, begin, min_shift, depth, |x| {
+            self.find_bin(x).map(|x| x.loffset)
+        });
+
+        let chunks = reg2bins(begin, end, min_shift, depth)
+            .into_iter()
+            .filter_map(|x| self.bin_chunks(x))
+            .flatten()
+            .filter(|x| x.end > min_offset)
+            .cloned()
+            .collect();
+        merge_chunks(chunks)
+    }
+}
+
+fn truncated() -> io::Error {
+    io::Error::new(io::ErrorKind::UnexpectedEof, "Truncated index")
+}
+
+fn read_count(reader: &mut &[u8]) -> Result<usize> {
+    reader.read_le_i32()?.try_into().map_err(invalid_length)
+}
+
+/// TBI or CSI index which decodes each sequence on first query.
+///
+/// Inflated index data is kept in memory, and only positions of sequences are scanned while loading.
+/// Bins and chunks of a sequence are decoded into [`CompactSequence`] when the sequence is queried at first time.
+/// Decoded sequences are shared by threads.
+pub struct LazyTabix {
+    header: Tabix,
+    csi: bool,
+    data: Vec<u8>,
+    sequence_ranges: Vec<std::ops::Range<usize>>,
+    /// Decoded sequences, or kind and message of an error while decoding
+    sequences:
+        Vec<std::sync::OnceLock<std::result::Result<CompactSequence, (io::ErrorKind, String)>>>,
+}
+
+impl LazyTabix {
+    /// Load TBI or CSI index. The format is detected from the magic number.
+    pub fn from_reader(reader: &mut impl Read) -> Result<Self> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(reader).read_to_end(&mut data)?;
+        let mut reader = &data[..];
+        let (header, csi) = Tabix::read_index_header(&mut reader)?;
+        let mut position = data.len() - reader.len();
+        let mut sequence_ranges = Vec::with_capacity(header.number_of_references as usize);
+        for _ in 0..header.number_of_references {
+            let length = CompactSequence::encoded_length(&data[position..], csi)?;
+            sequence_ranges.push(position..(position + length));
+            position += length;
+        }
+        let sequences = sequence_ranges
+            .iter()
+            .map(|_| std::sync::OnceLock::new())
+            .collect();
+        Ok(LazyTabix {
+            header,
+            csi,
+            data,
+            sequence_ranges,
+            sequences,
+        })
+    }
+
+    /// Index fields except sequences. Use this to find sequences or to parse records.
+    pub fn header(&self) -> &Tabix {
+        &self.header
+    }
+
+    /// Find index of a sequence by name
+    pub fn sequence_id(&self, name: &[u8]) -> Option<usize> {
+        self.header.sequence_id(name)
+    }
+
+    /// Decode bins of a sequence if it is not decoded yet.
+    pub fn sequence(&self, sequence_id: usize) -> Result<&CompactSequence> {
+        let range = self
+            .sequence_ranges
+            .get(sequence_id)
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "Invalid sequence ID"))?;
+        self.sequences[sequence_id]
+            .get_or_init(|| {
+                CompactSequence::from_bytes(&self.data[range.clone()], self.csi)
+                    .map_err(|x| (x.kind(), x.to_string()))
+            })
+            .as_ref()
+            .map_err(|(kind, message)| io::Error::new(*kind, message.clone()))
+    }
+
+    #[cfg(test)]
+    fn is_decoded(&self, sequence_id: usize) -> bool {
+        self.sequences[sequence_id].get().is_some()
+    }
+
+    /// Get merged and sorted chunks which may contain records overlapping with region [begin, end) (zero-based).
+    pub fn query(&self, sequence_id: usize, begin: i64, end: i64) -> Result<Vec<TabixChunk>> {
+        if sequence_id >= self.sequence_ranges.len() {
+            return Ok(Vec::new());
+        }
+        Ok(self
+            .sequence(sequence_id)?
+            .query(begin, end, self.header.min_shift, self.header.depth))
+    }
+
+    /// Get records overlapping with region [begin, end) (zero-based) of the sequence.
+    pub fn query_records<'a, R: BGZFRead>(
+        &'a self,
+        reader: &'a mut R,
+        sequence_id: usize,
+        begin: i64,
+        end: i64,
+    ) -> Result<TabixRecords<'a, R>> {
+        Ok(TabixRecords {
+            tabix: &self.header,
+            reader,
+            chunks: ChunkCursor::new(self.query(sequence_id, begin, end)?),
+            sequence_name: self.header.sequence_name(sequence_id).unwrap_or(b""),
+            begin,
+            end,
+            finished: false,
+            line: Vec::new(),
+        })
+    }
+}
+
+/// A record waiting for its block to be written
+struct PendingRecord {
+    sequence: Vec<u8>,
+    begin: i64,
+    end: i64,
+    uncompressed_begin: u64,
+    uncompressed_end: u64,
+    /// False for the last line without a newline
+    terminated: bool,
+}
+
+/// A BGZF writer which builds TBI or CSI index of written records.
+///
+/// Records must be sorted by position. Virtual file offsets of records are
+/// resolved when their blocks are written, so multi-threaded [`BGZFWriter`] can be used.
+/// Data already written to the [`BGZFWriter`], such as a header, is not indexed.
+/// ```
+/// use bgzip::tabix::{TabixBuilder, TabixWriter};
+/// use bgzip::BGZFWriter;
+/// use std::io::Write;
+/// # fn main() -> std::io::Result<()> {
+/// let mut data = Vec::new();
+/// let mut writer = TabixWriter::new(
+///     BGZFWriter::new(&mut data, flate2::Compression::default()),
+///     TabixBuilder::bed(),
+/// );
+/// writer.write_all(b"chr1\t100\t200\nchr1\t150\t300\nchr2\t10\t20\n")?;
+/// let tabix = writer.close()?;
+/// let mut index = Vec::new();
+/// tabix.write_tbi(&mut index)?;
+/// assert_eq!(tabix.names.len(), 2);
+/// # Ok(())
+/// # }
+/// ```
+pub struct TabixWriter<W: Write> {
+    writer: BGZFWriter<W>,
+    builder: TabixBuilder,
+    line: Vec<u8>,
+    line_begin: u64,
+    pending: std::collections::VecDeque<PendingRecord>,
+}
+
+impl<W: Write> TabixWriter<W> {
+    /// Create an indexing writer. Columns, meta character and skip lines are configured in `builder`.
+    pub fn new(mut writer: BGZFWriter<W>, builder: TabixBuilder) -> Self {
+        // Blocks holding data after `line_begin` are not completed yet, so they are all indexed in GZI
+        writer.enable_gzi();
+        let line_begin = writer.uncompressed_size();
+        TabixWriter {
+            writer,
+            builder,
+            line: Vec::new(),
+            line_begin,
+            pending: std::collections::VecDeque::new(),
+        }
+    }
+
+    /// Parse a completed line and keep its position until its block is written.
+    /// `terminated` is false for the last line without a newline.
+    fn add_line(&mut self, terminated: bool) -> Result<()> {
+        let line_end = self.line_begin + self.line.len() as u64 + u64::from(terminated);
+        let line = self.line.strip_suffix(b"\r").unwrap_or(&self.line);
+        if let Some(position) = self.builder.parse_line(line)? {
+            self.pending.push_back(PendingRecord {
+                sequence: position.sequence.to_vec(),
+                begin: position.begin,
+                end: position.end,
+                uncompressed_begin: self.line_begin,
+                uncompressed_end: line_end,
+                terminated,
+            });
+        }
+        self.line.clear();
+        self.line_begin = line_end;
+        Ok(())
+    }
+
+    /// Add records in written blocks to the index.
+    fn resolve(&mut self) -> Result<()> {
+        let (compressed_written, uncompressed_written) = self.writer.written_position();
+        let gzi = self.writer.gzi().unwrap();
+        let virtual_offset = |offset: u64| {
+            if offset == uncompressed_written {
+                return compressed_written << 16;
+            }
+            let block = gzi.find_block(offset);
+            block.compressed_offset << 16 | (offset - block.uncompressed_offset)
+        };
+        while let Some(record) = self.pending.front() {
+            if record.uncompressed_end > uncompressed_written {
+                break;
+            }
+            // A reader finds the end of the last line without a newline after the end-of-file marker
+            let end = if record.terminated {
+                virtual_offset(record.uncompressed_end)
+            } else {
+                (compressed_written + FOOTER_BYTES.len() as u64) << 16
+            };
+            self.builder.add_record(
+                &record.sequence,
+                record.begin,
+                record.end,
+                virtual_offset(record.uncompressed_begin),
+                end,
+            )?;
+            self.pending.pop_front();
+        }
+        Ok(())
+    }
+
+    /// Write end-of-file marker and return the index of written records.
+    pub fn close(mut self) -> Result<Tabix> {
+        if !self.line.is_empty() {
+            self.add_line(false)?;
+        }
+        self.writer.flush()?;
+        self.resolve()?;
+        let TabixWriter {
+            writer, builder, ..
+        } = self;
+        writer.close()?;
+        Ok(builder.finish())
+    }
+}
+
+impl<W: Write> Write for TabixWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> Result<usize> {
+        self.writer.write_all(buf)?;
+        let mut remain = buf;
+        while let Some(index) = memchr::memchr(b'\n', remain) {
+            self.line.extend_from_slice(&remain[..index]);
+            self.add_line(true)?;
+            remain = &remain[(index + 1)..];
+        }
+        self.line.extend_from_slice(remain);
+        self.resolve()?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> Result<()> {
+        self.writer.flush()?;
+        self.resolve()
+    }
+}
 
 #[cfg(test)]
 mod test {
@@ -214,4 +1799,482 @@ mod test {
 
         Ok(())
     }
+
+    #[test]
+    fn test_reg2bins() {
+        assert_eq!(reg2bins(0, 1, 14, 5), vec![0, 1, 9, 73, 585, 4681]);
+        assert_eq!(reg2bins(0, 0, 14, 5), Vec::<u32>::new());
+        let bins = reg2bins(1_000_000, 2_000_000, 14, 5);
+        for begin in (1_000_000..2_000_000).step_by(10_000) {
+            assert!(bins.contains(&(reg2bin(begin, begin + 1, 14, 5) as u32)));
+            assert!(bins.contains(&(reg2bin(begin, begin + 20_000, 14, 5) as u32)));
+        }
+        assert!(!bins.contains(&(reg2bin(2_100_000, 2_100_001, 14, 5) as u32)));
+        assert_eq!(
+            merge_chunks(vec![
+                TabixChunk {
+                    begin: 10 << 16,
+                    end: 20 << 16
+                },
+                TabixChunk {
+                    begin: 1 << 16,
+                    end: 2 << 16 | 100
+                },
+                TabixChunk {
+                    begin: 2 << 16 | 200,
+                    end: 3 << 16
+                },
+                TabixChunk {
+                    begin: 15 << 16,
+                    end: 18 << 16
+                },
+            ]),
+            vec![
+                TabixChunk {
+                    begin: 1 << 16,
+                    end: 3 << 16
+                },
+                TabixChunk {
+                    begin: 10 << 16,
+                    end: 20 << 16
+                },
+            ]
+        );
+    }
+
+    #[test]
+    fn test_query() -> Result<()> {
+        let tabix = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        check_query(&tabix)?;
+
+        // Reuse a reader left inside the chunks of a later query
+        let path = "testfiles/common_all_20180418_half.vcf.gz";
+        let mut reader = crate::BGZFReader::new(File::open(path)?);
+        for (begin, end) in [(1_500_000, 1_600_000), (1_000_000, 2_000_000)].iter() {
+            let mut fresh = crate::BGZFReader::new(File::open(path)?);
+            let expected: Vec<Vec<u8>> = tabix
+                .query_records(&mut fresh, 0, *begin, *end)
+                .collect::<Result<_>>()?;
+            let records: Vec<Vec<u8>> = tabix
+                .query_records(&mut reader, 0, *begin, *end)
+                .collect::<Result<_>>()?;
+            assert!(!expected.is_empty());
+            assert_eq!(records, expected);
+        }
+        Ok(())
+    }
+
+    fn check_query(tabix: &Tabix) -> Result<()> {
+        let mut reader =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        check_query_with_reader(tabix, &mut reader)
+    }
+
+    fn check_query_with_reader<R: BGZFRead>(tabix: &Tabix, reader: &mut R) -> Result<()> {
+        let all_records: Vec<Vec<u8>> = io::BufReader::new(flate2::read::MultiGzDecoder::new(
+            File::open("testfiles/common_all_20180418_half.vcf.gz")?,
+        ))
+        .split(b'\n')
+        .collect::<Result<_>>()?;
+
+        for (sequence, begin, end) in [
+            ("1", 72700624, 72700625),
+            ("1", 1_000_000, 2_000_000),
+            ("1", 0, 1_000_000),
+            ("2", 100_000_000, 150_000_000),
+            ("22", 0, 1 << 29),
+            ("Y", 0, 1 << 29),
+            ("X", 155_000_000, 170_000_000),
+        ]
+        .iter()
+        {
+            let sequence_id = tabix.sequence_id(sequence.as_bytes()).unwrap();
+            let records: Vec<Vec<u8>> = tabix
+                .query_records(reader, sequence_id, *begin, *end)
+                .collect::<Result<_>>()?;
+            let expected: Vec<Vec<u8>> = all_records
+                .iter()
+                .filter(|x| match tabix.record_position(x).unwrap() {
+                    Some(position) => {
+                        position.sequence == sequence.as_bytes()
+                            && position.begin < *end
+                            && *begin < position.end
+                    }
+                    None => false,
+                })
+                .cloned()
+                .collect();
+            assert!(!expected.is_empty());
+            assert_eq!(records, expected);
+        }
+
+        let records = tabix.query_records(reader, 0, 72700624, 72700625);
+        assert_eq!(records.count(), 1);
+        assert!(tabix.sequence_id(b"chr1").is_none());
+        Ok(())
+    }
+
+    #[test]
+    fn test_csi_read() -> Result<()> {
+        let tabix = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        let csi = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.csi",
+        )?)?;
+        assert_eq!(csi.min_shift, 14);
+        assert!(csi.sequences.iter().all(|x| x.intervals.is_empty()));
+        assert_eq!(csi.names, tabix.names);
+        assert_eq!(csi.format, tabix.format);
+        check_query(&csi)
+    }
+
+    #[test]
+    fn test_build() -> Result<()> {
+        let mut reader =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        let mut tbi_builder = TabixBuilder::vcf();
+        let mut csi_builder = TabixBuilder::vcf();
+        csi_builder.set_binning(12, binning_depth(12, 1 << 32));
+        assert_eq!(binning_depth(12, 1 << 32), 7);
+        let mut line = Vec::new();
+        loop {
+            let begin = reader.bgzf_pos();
+            line.clear();
+            if reader.read_until(b'\n', &mut line)? == 0 {
+                break;
+            }
+            let end = reader.bgzf_pos();
+            let line = line.strip_suffix(b"\n").unwrap_or(&line);
+            tbi_builder.add_line(line, begin, end)?;
+            csi_builder.add_line(line, begin, end)?;
+        }
+
+        let tbi = tbi_builder.finish();
+        let expected = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        assert_eq!(tbi.names, expected.names);
+        assert_eq!(
+            tbi.length_of_concatenated_sequence_names,
+            expected.length_of_concatenated_sequence_names
+        );
+        check_query(&tbi)?;
+        let mut data = Vec::new();
+        tbi.write_tbi(&mut data)?;
+        let loaded = Tabix::from_reader(&mut &data[..])?;
+        assert_eq!(loaded.sequences[0].intervals, tbi.sequences[0].intervals);
+        check_query(&loaded)?;
+
+        let csi = csi_builder.finish();
+        assert!(csi.write_tbi(&mut Vec::new()).is_err());
+        check_query(&csi)?;
+        let mut data = Vec::new();
+        csi.write_csi(&mut data)?;
+        let mut loaded = Tabix::from_reader(&mut &data[..])?;
+        for one in loaded.sequences.iter_mut() {
+            assert!(one.intervals.is_empty());
+        }
+        for (one, built) in loaded.sequences.iter_mut().zip(csi.sequences.iter()) {
+            one.number_of_intervals = built.number_of_intervals;
+            one.intervals = built.intervals.clone();
+        }
+        assert_eq!(loaded, csi);
+        check_query(&Tabix::from_reader(&mut &data[..])?)?;
+
+        for threads in [1, 4].iter() {
+            let file = File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+            assert_eq!(TabixBuilder::vcf().build_parallel(file, *threads)?, tbi);
+            let file = File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+            let mut builder = TabixBuilder::vcf();
+            builder.set_binning(12, binning_depth(12, 1 << 32));
+            assert_eq!(builder.build_parallel(file, *threads)?, csi);
+        }
+
+        let mut builder = TabixBuilder::vcf();
+        builder.add_line(b"1\t200\t.\tA\tT", 0, 10)?;
+        assert!(builder.add_line(b"1\t100\t.\tA\tT", 10, 20).is_err());
+        builder.add_line(b"2\t100\t.\tA\tT", 10, 20)?;
+        assert!(builder.add_line(b"1\t300\t.\tA\tT", 20, 30).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_build_parallel() -> Result<()> {
+        // Long lines across blocks and shards, a skipped line and no newline at the end
+        let mut data = b"chrom begin end\n".to_vec();
+        for i in 0..3000 {
+            let sequence = if i < 2000 { "chr1" } else { "chr2" };
+            let padding = if i % 7 == 0 { 60_000 } else { i % 100 };
+            writeln!(
+                data,
+                "{}\t{}\t{}\t{}",
+                sequence,
+                i * 1000,
+                i * 1000 + 5000,
+                "x".repeat(padding)
+            )?;
+        }
+        data.pop();
+        let mut compressed = Vec::new();
+        let mut writer = BGZFWriter::new(&mut compressed, flate2::Compression::none());
+        writer.write_all(&data)?;
+        writer.close()?;
+
+        let bed = || {
+            let mut builder = TabixBuilder::bed();
+            builder.tabix.skip = 1;
+            builder
+        };
+        let mut reader = crate::BGZFSliceReader::new(&compressed[..]);
+        let mut expected = bed();
+        let mut line = Vec::new();
+        loop {
+            let begin = reader.bgzf_pos();
+            line.clear();
+            if reader.read_until(b'\n', &mut line)? == 0 {
+                break;
+            }
+            let line = line.strip_suffix(b"\n").unwrap_or(&line);
+            expected.add_line(line, begin, reader.bgzf_pos())?;
+        }
+        let expected = expected.finish();
+        assert_eq!(expected.names.len(), 2);
+        for threads in [1, 3].iter() {
+            let tabix = bed().build_parallel(&compressed[..], *threads)?;
+            assert_eq!(tabix, expected);
+        }
+
+        // A sequence after another sequence, and a truncated file
+        let mut unsorted = data.clone();
+        unsorted.extend_from_slice(b"\nchr1\t1\t2\t.\n");
+        let mut compressed = Vec::new();
+        let mut writer = BGZFWriter::new(&mut compressed, flate2::Compression::none());
+        writer.write_all(&unsorted)?;
+        writer.close()?;
+        assert!(bed().build_parallel(&compressed[..], 2).is_err());
+        assert!(bed().build_parallel(&compressed[..1000], 2).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_partition() -> Result<()> {
+        let compressed = std::fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&compressed[..]).read_to_end(&mut expected)?;
+        let tabix = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        for n in [1, 5, 300].iter() {
+            let ranges = tabix.partition(compressed.len() as u64, *n);
+            assert_eq!(ranges.len(), *n);
+            let mut reader = crate::BGZFSliceReader::new(&compressed[..]);
+            let mut data = Vec::new();
+            for range in ranges.iter() {
+                reader.bgzf_seek(range.begin).map_err(to_io)?;
+                while reader.bgzf_pos() < range.end {
+                    if reader.read_until(b'\n', &mut data)? == 0 {
+                        break;
+                    }
+                }
+            }
+            assert_eq!(data, expected);
+            if *n == 5 {
+                for one in ranges.iter() {
+                    let size = (one.end >> 16) - (one.begin >> 16);
+                    assert!(size > 500_000 && size < 800_000, "{}", size);
+                }
+            }
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_tabix_writer() -> Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?)
+            .read_to_end(&mut data)?;
+
+        // Lines before `start` are written before wrapping the writer, and they are not indexed
+        let split = 300_000 + data[300_000..].iter().position(|x| *x == b'\n').unwrap() + 1;
+        for (threads, start) in [(1, 0), (4, 0), (1, split), (4, split)].iter() {
+            let mut compressed = Vec::new();
+            let mut bgzf_writer =
+                BGZFWriter::with_threads(&mut compressed, flate2::Compression::fast(), *threads);
+            bgzf_writer.write_all(&data[..*start])?;
+            let mut writer = TabixWriter::new(bgzf_writer, TabixBuilder::vcf());
+            for one in data[*start..].chunks(12345) {
+                writer.write_all(one)?;
+            }
+            let tabix = writer.close()?;
+
+            // Same as the index built by reading the written file
+            let mut reader = crate::BGZFSliceReader::new(&compressed[..]);
+            let mut builder = TabixBuilder::vcf();
+            let mut line = Vec::new();
+            let mut offset = 0;
+            loop {
+                let begin = reader.bgzf_pos();
+                line.clear();
+                if reader.read_until(b'\n', &mut line)? == 0 {
+                    break;
+                }
+                offset += line.len();
+                if offset <= *start {
+                    continue;
+                }
+                let line = line.strip_suffix(b"\n").unwrap_or(&line);
+                builder.add_line(line, begin, reader.bgzf_pos())?;
+            }
+            assert_eq!(tabix, builder.finish());
+            if *start == 0 {
+                check_query_with_reader(&tabix, &mut reader)?;
+            }
+        }
+
+        // No newline at the end
+        let mut compressed = Vec::new();
+        let mut writer = TabixWriter::new(
+            BGZFWriter::new(&mut compressed, flate2::Compression::fast()),
+            TabixBuilder::bed(),
+        );
+        writer.write_all(b"chr1\t100\t200\nchr2\t10\t20")?;
+        let tabix = writer.close()?;
+        let expected = TabixBuilder::bed().build_parallel(&compressed[..], 1)?;
+        assert_eq!(tabix, expected);
+        assert!(tabix.sequence_id(b"chr2").is_some());
+        Ok(())
+    }
+
+    #[test]
+    fn test_lazy_tabix() -> Result<()> {
+        for path in [
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+            "testfiles/common_all_20180418_half.vcf.gz.csi",
+        ]
+        .iter()
+        {
+            let tabix = Tabix::from_reader(&mut File::open(path)?)?;
+            let lazy = LazyTabix::from_reader(&mut File::open(path)?)?;
+            assert_eq!(lazy.header().names, tabix.names);
+            assert!(lazy.header().sequences.is_empty());
+
+            let sequence_id = lazy.sequence_id(b"22").unwrap();
+            assert!(lazy.query(sequence_id, 0, 1 << 29)?.len() > 0);
+            assert!(lazy.is_decoded(sequence_id));
+            assert!(!lazy.is_decoded(0));
+
+            for sequence_id in 0..tabix.sequences.len() {
+                let sequence = lazy.sequence(sequence_id)?;
+                assert_eq!(
+                    sequence.intervals(),
+                    &tabix.sequences[sequence_id].intervals[..]
+                );
+                for (bin, one) in tabix.sequences[sequence_id].bins.iter() {
+                    assert_eq!(sequence.bin_chunks(*bin), Some(&one.chunks[..]));
+                }
+                for begin in (0..250_000_000).step_by(7_000_000) {
+                    for length in [1, 10_000, 3_000_000].iter() {
+                        assert_eq!(
+                            lazy.query(sequence_id, begin, begin + length)?,
+                            tabix.query(sequence_id, begin, begin + length)
+                        );
+                    }
+                }
+            }
+            assert!(lazy.query(tabix.sequences.len(), 0, 100)?.is_empty());
+
+            let mut reader =
+                crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+            let records = lazy.query_records(&mut reader, 0, 72700624, 72700625)?;
+            assert_eq!(records.count(), 1);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_query_regions() -> Result<()> {
+        let tabix = Tabix::from_reader(&mut File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.tbi",
+        )?)?;
+        let chr1 = tabix.sequence_id(b"1").unwrap();
+        let chr2 = tabix.sequence_id(b"2").unwrap();
+        let mut regions: Vec<TabixRegion> = (0..200)
+            .map(|i| TabixRegion::new(chr1, 1_000_000 + i * 1_000_000, 1_050_000 + i * 1_000_000))
+            .collect();
+        regions.reverse();
+        regions.extend(&[
+            TabixRegion::new(chr2, 100_000_000, 150_000_000),
+            TabixRegion::new(chr1, 2_000_000, 3_000_000),
+            TabixRegion::new(chr1, 2_000_000, 3_000_000),
+            TabixRegion::new(chr1, 72700624, 72700625),
+            TabixRegion::new(chr1, 100, 100),
+            TabixRegion::new(1000, 0, 100),
+        ]);
+
+        let mut reader =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        let mut expected = Vec::new();
+        for one in &regions {
+            let records: Vec<Vec<u8>> = tabix
+                .query_records(&mut reader, one.sequence_id, one.begin, one.end)
+                .collect::<Result<_>>()?;
+            expected.push(records);
+        }
+        assert!(expected.iter().filter(|x| !x.is_empty()).count() > 50);
+        let single_stats = reader.stats();
+
+        let mut reader =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        reader.set_cache_limit(1);
+        let mut result = vec![Vec::new(); regions.len()];
+        for one in tabix.query_regions(&mut reader, &regions) {
+            let (index, record) = one?;
+            result[index].push(record);
+        }
+        assert_eq!(result, expected);
+
+        // Each block is inflated once even without cache
+        let batch_stats = reader.stats();
+        let mut blocks = std::collections::HashSet::new();
+        let mut chunks = Vec::new();
+        for one in &regions {
+            chunks.extend(tabix.query(one.sequence_id, one.begin, one.end));
+        }
+        let all_blocks: Vec<u64> = crate::BGZFBlocks::new(io::BufReader::new(File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?))
+        .map(|x| x.map(|x| x.position))
+        .collect::<std::result::Result<_, _>>()
+        .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+        for one in merge_chunks(chunks) {
+            for block in all_blocks
+                .iter()
+                .filter(|x| (one.begin >> 16) <= **x && **x <= (one.end >> 16))
+            {
+                blocks.insert(*block);
+            }
+        }
+        assert!(batch_stats.blocks_inflated <= blocks.len() as u64);
+        assert!(batch_stats.blocks_inflated < single_stats.blocks_inflated);
+
+        // Reuse a reader left inside the first chunk
+        tabix
+            .query_records(&mut reader, chr1, 1_500_000, 1_600_000)
+            .count();
+        let region = TabixRegion::new(chr1, 1_000_000, 2_000_000);
+        let records: Vec<Vec<u8>> = tabix
+            .query_regions(&mut reader, &[region])
+            .map(|x| x.map(|x| x.1))
+            .collect::<Result<_>>()?;
+        let mut fresh =
+            crate::BGZFReader::new(File::open("testfiles/common_all_20180418_half.vcf.gz")?);
+        let expected: Vec<Vec<u8>> = tabix
+            .query_records(&mut fresh, chr1, 1_000_000, 2_000_000)
+            .collect::<Result<_>>()?;
+        assert_eq!(records, expected);
+        Ok(())
+    }
 }
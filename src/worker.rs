@@ -0,0 +1,126 @@
+use std::collections::BTreeMap;
+use std::sync::{mpsc, Arc, Mutex};
+use std::thread;
+
+/// A fixed size pool of worker threads which returns results in submission order.
+///
+/// Each worker thread owns its own job handler created by the factory function,
+/// so per-thread state (e.g. compressor objects) can be reused across jobs.
+pub(crate) struct OrderedWorkers<T: Send + 'static, U: Send + 'static> {
+    sender: Option<mpsc::Sender<(u64, T)>>,
+    receiver: mpsc::Receiver<(u64, U)>,
+    handles: Vec<thread::JoinHandle<()>>,
+    pending: BTreeMap<u64, U>,
+    next_submit: u64,
+    next_receive: u64,
+}
+
+impl<T: Send + 'static, U: Send + 'static> OrderedWorkers<T, U> {
+    /// Spawn `threads` worker threads. `factory` is called once in each worker thread.
+    pub fn new<F, G>(threads: usize, factory: F) -> Self
+    where
+        F: Fn() -> G + Send + Sync + 'static,
+        G: FnMut(T) -> U,
+    {
+        let (job_sender, job_receiver) = mpsc::channel::<(u64, T)>();
+        let (result_sender, result_receiver) = mpsc::channel();
+        let job_receiver = Arc::new(Mutex::new(job_receiver));
+        let factory = Arc::new(factory);
+        let handles = (0..threads.max(1))
+            .map(|_| {
+                let job_receiver = job_receiver.clone();
+                let result_sender = result_sender.clone();
+                let factory = factory.clone();
+                thread::spawn(move || {
+                    let mut handler = factory();
+                    loop {
+                        let job = job_receiver.lock().unwrap().recv();
+                        match job {
+                            Ok((index, job)) => {
+                                if result_sender.send((index, handler(job))).is_err() {
+                                    break;
+                                }
+                            }
+                            Err(_) => break,
+                        }
+                    }
+                })
+            })
+            .collect();
+
+        OrderedWorkers {
+            sender: Some(job_sender),
+            receiver: result_receiver,
+            handles,
+            pending: BTreeMap::new(),
+            next_submit: 0,
+            next_receive: 0,
+        }
+    }
+
+    /// Number of worker threads
+    pub fn threads(&self) -> usize {
+        self.handles.len()
+    }
+
+    /// Number of jobs submitted but not yet returned by `recv`.
+    pub fn in_flight(&self) -> usize {
+        (self.next_submit - self.next_receive) as usize
+    }
+
+    /// Queue a new job.
+    pub fn submit(&mut self, job: T) {
+        self.sender
+            .as_ref()
+            .unwrap()
+            .send((self.next_submit, job))
+            .expect("worker thread panicked");
+        self.next_submit += 1;
+    }
+
+    /// Wait for the result of the oldest job. Returns `None` if no job is in flight.
+    pub fn recv(&mut self) -> Option<U> {
+        if self.in_flight() == 0 {
+            return None;
+        }
+        while !self.pending.contains_key(&self.next_receive) {
+            let (index, result) = self.receiver.recv().expect("worker thread panicked");
+            self.pending.insert(index, result);
+        }
+        let result = self.pending.remove(&self.next_receive);
+        self.next_receive += 1;
+        result
+    }
+}
+
+impl<T: Send + 'static, U: Send + 'static> Drop for OrderedWorkers<T, U> {
+    fn drop(&mut self) {
+        self.sender.take();
+        for one in self.handles.drain(..) {
+            let _ = one.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_ordered() {
+        let mut workers = OrderedWorkers::new(4, || {
+            |x: u64| {
+                thread::sleep(std::time::Duration::from_millis((x * 7) % 5));
+                x * 2
+            }
+        });
+        for i in 0..100 {
+            workers.submit(i);
+        }
+        assert_eq!(workers.in_flight(), 100);
+        for i in 0..100 {
+            assert_eq!(workers.recv(), Some(i * 2));
+        }
+        assert_eq!(workers.recv(), None);
+    }
+}
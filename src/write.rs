@@ -1,53 +1,422 @@
-use crate::header;
-use flate2::write::DeflateEncoder;
-use flate2::Crc;
+use crate::blocks::BGZFBlocks;
+use crate::codec::{BlockDeflater, DeflateCodec, Flate2Codec};
+use crate::gzi::GZI;
+use crate::read::BlockDecompressor;
+use crate::slice::find_block;
+use crate::stats::WriterStats;
+use crate::worker::OrderedWorkers;
+use crate::BGZFError;
 use std::convert::TryInto;
-use std::io::{self, Write};
+use std::io::{self, Read, Seek, Write};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
 /// A BGZF writer
 pub struct BGZFWriter<W: io::Write> {
     writer: W,
     buffer: Vec<u8>,
-    compressed_buffer: Vec<u8>,
+    /// Compressed blocks not written to `writer` yet
+    output: Vec<u8>,
+    output_buffer_size: usize,
     compress_block_unit: usize,
-    level: flate2::Compression,
+    compressor: BlockCompressor,
+    workers: Option<OrderedWorkers<(Vec<u8>, Vec<u8>), DeflatedBlock>>,
+    buffer_pool: Vec<Vec<u8>>,
+    compressed_position: u64,
+    uncompressed_position: u64,
+    /// Size of uncompressed data being compressed by worker threads
+    in_flight_size: u64,
+    gzi: Option<GZI>,
+    stats: WriterStats,
     closed: bool,
 }
 
-const COMPRESS_BLOCK_UNIT: usize = 1024 * 16;
+/// Buffer of uncompressed data, compressed blocks and time spent by a worker thread
+type DeflatedBlock = (Vec<u8>, io::Result<Vec<u8>>, Duration);
+
+pub(crate) const COMPRESS_BLOCK_UNIT: usize = 0xff00;
+const DEFAULT_OUTPUT_BUFFER_SIZE: usize = 256 * 1024;
+const MAX_BLOCK_SIZE: usize = 0x10000;
 
 impl<W: io::Write> BGZFWriter<W> {
     /// Create new BGZF writer from std::io::Write
     pub fn new(writer: W, level: flate2::Compression) -> Self {
         BGZFWriter {
             writer,
-            buffer: Vec::new(),
-            compressed_buffer: Vec::new(),
+            buffer: Vec::with_capacity(COMPRESS_BLOCK_UNIT),
+            output: Vec::new(),
+            output_buffer_size: DEFAULT_OUTPUT_BUFFER_SIZE,
             compress_block_unit: COMPRESS_BLOCK_UNIT,
-            level,
+            compressor: BlockCompressor::new(level),
+            workers: None,
+            buffer_pool: Vec::new(),
+            compressed_position: 0,
+            uncompressed_position: 0,
+            in_flight_size: 0,
+            gzi: None,
+            stats: WriterStats::default(),
             closed: false,
         }
     }
 
-    fn write_block(&mut self) -> io::Result<()> {
-        self.compressed_buffer.clear();
-        let uncompressed_block_size = self.compress_block_unit.min(self.buffer.len());
-        let mut encoder = DeflateEncoder::new(&mut self.compressed_buffer, self.level);
-        encoder.write_all(&self.buffer[..uncompressed_block_size])?;
-        encoder.finish()?;
+    /// Create new multi-threaded BGZF writer from std::io::Write
+    ///
+    /// Blocks are compressed by `threads` worker threads and written in order,
+    /// so the output is identical to the output of single-threaded writer.
+    pub fn with_threads(writer: W, level: flate2::Compression, threads: usize) -> Self {
+        BGZFWriter::with_codec(writer, level, threads, Arc::new(Flate2Codec))
+    }
+
+    /// Create new BGZF writer which compresses blocks with `codec`.
+    ///
+    /// See [`BGZFWriter::with_threads`] for `threads`.
+    pub fn with_codec(
+        writer: W,
+        level: flate2::Compression,
+        threads: usize,
+        codec: Arc<dyn DeflateCodec>,
+    ) -> Self {
+        let mut bgzf_writer = BGZFWriter::new(writer, level);
+        bgzf_writer.compressor = BlockCompressor::with_codec(&*codec, level);
+        if threads > 1 {
+            bgzf_writer.workers = Some(OrderedWorkers::new(threads, move || {
+                let mut compressor = BlockCompressor::with_codec(&*codec, level);
+                move |(data, mut block): (Vec<u8>, Vec<u8>)| {
+                    let start = Instant::now();
+                    let result = compressor.compress(&data, &mut block).map(|_| block);
+                    (data, result, start.elapsed())
+                }
+            }));
+        }
+        bgzf_writer
+    }
+
+    /// Set size of uncompressed data in one block. Default size is 65280 bytes, same as htslib.
+    ///
+    /// The size must be between 1 and 65536 bytes. If data is buffered, it is written as a block before changing the size.
+    /// A block which cannot be compressed into 64KiB is split into smaller blocks.
+    pub fn set_block_size(&mut self, size: usize) -> io::Result<()> {
+        if size == 0 || size > MAX_BLOCK_SIZE {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "Block size must be between 1 and 65536",
+            ));
+        }
+        if !self.buffer.is_empty() {
+            self.write_buffered_block()?;
+        }
+        self.compress_block_unit = size;
+        Ok(())
+    }
+
+    /// Set size of compressed blocks collected before writing them to the underlying writer at once.
+    /// Default size is 256KiB.
+    ///
+    /// Blocks are written with one `write_all` call for each batch, which reduces system calls of unbuffered writers
+    /// such as `File`. Set 0 to write each block immediately. Collected blocks are written before changing the size.
+    pub fn set_output_buffer_size(&mut self, size: usize) -> io::Result<()> {
+        self.write_output()?;
+        self.output_buffer_size = size;
+        Ok(())
+    }
+
+    /// Start building GZI index of written blocks.
+    ///
+    /// Blocks written before calling this method are not indexed,
+    /// but the index is still valid because any block can be a start point of seeking.
+    pub fn enable_gzi(&mut self) {
+        if self.gzi.is_none() {
+            self.gzi = Some(GZI::new());
+        }
+    }
+
+    /// GZI index of blocks written so far. Call `flush` before this method to index all data.
+    pub fn gzi(&self) -> Option<&GZI> {
+        self.gzi.as_ref()
+    }
+
+    /// Counters of this writer. Counting is cheap enough to be always enabled.
+    ///
+    /// Blocks still buffered or being compressed by worker threads are not counted. Call `flush` to count all data.
+    pub fn stats(&self) -> WriterStats {
+        WriterStats {
+            compressed_bytes: self.compressed_position,
+            uncompressed_bytes: self.uncompressed_position,
+            ..self.stats
+        }
+    }
+
+    /// Compressed and uncompressed size of completed blocks, including blocks not written to the underlying writer yet
+    pub(crate) fn written_position(&self) -> (u64, u64) {
+        (self.compressed_position, self.uncompressed_position)
+    }
 
-        let mut crc = Crc::new();
-        crc.update(&self.buffer[..uncompressed_block_size]);
+    /// Uncompressed size of all data written to this writer, including data buffered or being compressed
+    pub(crate) fn uncompressed_size(&self) -> u64 {
+        self.uncompressed_position + self.in_flight_size + self.buffer.len() as u64
+    }
 
-        let header =
-            header::BGZFHeader::new(true, 0, self.compressed_buffer.len().try_into().unwrap());
-        header.write(&mut self.writer)?;
-        self.writer.write_all(&self.compressed_buffer)?;
-        self.buffer.drain(..uncompressed_block_size);
-        self.writer.write_all(&crc.sum().to_le_bytes())?;
-        self.writer
-            .write_all(&(uncompressed_block_size as u32).to_le_bytes())?;
+    /// Record written blocks. `blocks` may contain two or more blocks if data was split while compression.
+    fn add_blocks(
+        compressed_position: &mut u64,
+        uncompressed_position: &mut u64,
+        written_blocks: &mut u64,
+        gzi: Option<&mut GZI>,
+        blocks: &[u8],
+    ) {
+        let mut gzi = gzi;
+        let mut remain = blocks;
+        while remain.len() >= BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE {
+            let block_size =
+                u16::from_le_bytes([remain[BLOCK_HEADER_SIZE - 2], remain[BLOCK_HEADER_SIZE - 1]])
+                    as usize
+                    + 1;
+            let (block, next) = remain.split_at(block_size);
+            let isize = u32::from_le_bytes(block[(block_size - 4)..].try_into().unwrap());
+            if let Some(gzi) = gzi.as_mut() {
+                gzi.add_block(*compressed_position, *uncompressed_position);
+            }
+            *compressed_position += block_size as u64;
+            *uncompressed_position += u64::from(isize);
+            *written_blocks += 1;
+            remain = next;
+        }
+    }
 
+    /// Write buffered data as a block, even if the block is not full.
+    ///
+    /// Following data starts from a new block. Nothing is written if no data is buffered.
+    pub fn flush_block(&mut self) -> io::Result<()> {
+        if !self.buffer.is_empty() {
+            self.write_buffered_block()?;
+        }
+        Ok(())
+    }
+
+    /// Get BGZF virtual file offset of the next byte to be written,
+    /// which is equal to virtual file offset while reading described in [BGZF format](https://samtools.github.io/hts-specs/SAMv1.pdf).
+    ///
+    /// This method is a full synchronization point: multi-threaded writer waits for all blocks being compressed
+    /// to find their compressed size. It may also end the current block early, when buffered data is larger than
+    /// 65280 bytes after [`BGZFWriter::set_block_size`], so the output can differ from a writer without this call.
+    /// To index every record, use [`TabixWriter`](crate::tabix::TabixWriter), which keeps uncompressed offsets
+    /// and resolves them after their blocks are written.
+    pub fn bgzf_pos(&mut self) -> io::Result<u64> {
+        // Buffered data larger than this size might be split into two blocks
+        if self.buffer.len() > COMPRESS_BLOCK_UNIT {
+            self.write_buffered_block()?;
+        }
+        while self.write_compressed_block()? {}
+        Ok(self.compressed_position << 16 | self.buffer.len() as u64)
+    }
+
+    fn take_buffer(&mut self) -> Vec<u8> {
+        self.buffer_pool
+            .pop()
+            .unwrap_or_else(|| Vec::with_capacity(self.compress_block_unit))
+    }
+
+    fn recycle_buffer(&mut self, mut buffer: Vec<u8>) {
+        buffer.clear();
+        self.buffer_pool.push(buffer);
+    }
+
+    /// Compress and write buffered data as one block.
+    fn write_buffered_block(&mut self) -> io::Result<()> {
+        if self.workers.is_some() {
+            let next_buffer = self.take_buffer();
+            let data = std::mem::replace(&mut self.buffer, next_buffer);
+            return self.submit_block(data);
+        }
+
+        let buffer = std::mem::take(&mut self.buffer);
+        let result = self.write_block(&buffer);
+        self.buffer = buffer;
+        self.buffer.clear();
+        result
+    }
+
+    /// Compress and write `data` as one block.
+    fn write_block(&mut self, data: &[u8]) -> io::Result<()> {
+        if self.workers.is_some() {
+            let mut buffer = self.take_buffer();
+            buffer.extend_from_slice(data);
+            return self.submit_block(buffer);
+        }
+
+        let start = Instant::now();
+        let output_start = self.output.len();
+        let result = self.compressor.append(data, &mut self.output);
+        self.stats.codec_time += start.elapsed();
+        if let Err(e) = result {
+            self.output.truncate(output_start);
+            return Err(e);
+        }
+        self.add_output(output_start)
+    }
+
+    /// Record blocks appended to the output buffer after `output_start`, and write the buffer if it is full.
+    fn add_output(&mut self, output_start: usize) -> io::Result<()> {
+        Self::add_blocks(
+            &mut self.compressed_position,
+            &mut self.uncompressed_position,
+            &mut self.stats.blocks_deflated,
+            self.gzi.as_mut(),
+            &self.output[output_start..],
+        );
+        if self.output.len() >= self.output_buffer_size {
+            self.write_output()?;
+        }
+        Ok(())
+    }
+
+    /// Write collected blocks to the underlying writer.
+    fn write_output(&mut self) -> io::Result<()> {
+        if !self.output.is_empty() {
+            let start = Instant::now();
+            self.writer.write_all(&self.output)?;
+            self.stats.io_time += start.elapsed();
+            self.output.clear();
+        }
+        Ok(())
+    }
+
+    /// Pass `data` to worker threads. The oldest compressed block is written if too many blocks are in flight.
+    fn submit_block(&mut self, data: Vec<u8>) -> io::Result<()> {
+        let block = self.take_buffer();
+        self.in_flight_size += data.len() as u64;
+        let workers = self.workers.as_mut().unwrap();
+        workers.submit((data, block));
+        if workers.in_flight() >= workers.threads() * 2 {
+            self.write_compressed_block()?;
+        }
+        Ok(())
+    }
+
+    /// Wait for the oldest block compressed by worker threads and write it.
+    fn write_compressed_block(&mut self) -> io::Result<bool> {
+        if let Some((data, result, time)) = self.workers.as_mut().and_then(|x| x.recv()) {
+            self.stats.codec_time += time;
+            self.in_flight_size -= data.len() as u64;
+            let block = result?;
+            let output_start = self.output.len();
+            self.output.extend_from_slice(&block);
+            self.recycle_buffer(data);
+            self.recycle_buffer(block);
+            self.add_output(output_start)?;
+            Ok(true)
+        } else {
+            Ok(false)
+        }
+    }
+
+    /// Write a compressed block as is. Buffered data is written as a block before it.
+    ///
+    /// `block` must be a whole BGZF block including header and footer, such as [`BGZFRawBlock::data`](crate::BGZFRawBlock::data).
+    pub fn write_raw_block(&mut self, block: &[u8]) -> io::Result<()> {
+        match find_block(block) {
+            Ok(Some((_, block_size))) if block_size == block.len() => (),
+            _ => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidInput,
+                    "Not a BGZF block",
+                ))
+            }
+        }
+        self.flush_block()?;
+        while self.write_compressed_block()? {}
+        let output_start = self.output.len();
+        self.output.extend_from_slice(block);
+        self.add_output(output_start)
+    }
+
+    /// Copy all blocks of BGZF data from `reader` without recompression.
+    ///
+    /// Empty blocks such as end-of-file markers are skipped, so BGZF files can be concatenated
+    /// by appending them to one writer one by one.
+    /// ```
+    /// use bgzip::{BGZFReader, BGZFWriter};
+    /// use std::io::Read;
+    /// # fn main() -> Result<(), bgzip::BGZFError> {
+    /// let mut merged = Vec::new();
+    /// let mut writer = BGZFWriter::new(&mut merged, flate2::Compression::default());
+    /// for _ in 0..2 {
+    ///     let file = std::fs::File::open("testfiles/common_all_20180418_half.vcf.gz")?;
+    ///     writer.append_bgzf(file)?;
+    /// }
+    /// writer.close()?;
+    ///
+    /// let mut data = Vec::new();
+    /// BGZFReader::new(std::io::Cursor::new(merged)).read_to_end(&mut data)?;
+    /// assert_eq!(data.len(), 17_229_639 * 2);
+    /// # Ok(())
+    /// # }
+    /// ```
+    pub fn append_bgzf<R: Read>(&mut self, reader: R) -> Result<(), BGZFError> {
+        for block in BGZFBlocks::new(io::BufReader::new(reader)) {
+            let block = block?;
+            if !block.is_empty() {
+                self.write_raw_block(&block.data)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Copy uncompressed data between virtual file offsets `begin` and `end` of BGZF data in `reader`.
+    ///
+    /// Blocks entirely in the range are copied without recompression. Only partial blocks at
+    /// the beginning and the end are inflated and compressed again.
+    pub fn append_bgzf_range<R: Read + Seek>(
+        &mut self,
+        mut reader: R,
+        begin: u64,
+        end: u64,
+    ) -> Result<(), BGZFError> {
+        if end <= begin {
+            return Ok(());
+        }
+        let (begin_block, begin_offset) = (begin >> 16, (begin & 0xffff) as usize);
+        let (end_block, end_offset) = (end >> 16, (end & 0xffff) as usize);
+        reader.seek(io::SeekFrom::Start(begin_block))?;
+        let mut blocks = BGZFBlocks::with_position(io::BufReader::new(reader), begin_block);
+        let mut decompressor = BlockDecompressor::new();
+        let mut data = Vec::new();
+
+        while let Some(block) = blocks.next_block()? {
+            if block.position > end_block || (block.position == end_block && end_offset == 0) {
+                break;
+            }
+            let first = block.position == begin_block;
+            let last = block.position == end_block;
+            if (first && begin_offset > 0) || last {
+                data.clear();
+                decompressor.decompress_blocks(&block.data, &mut data)?;
+                let from = if first { begin_offset } else { 0 };
+                let to = if last {
+                    end_offset.min(data.len())
+                } else {
+                    data.len()
+                };
+                if from > to {
+                    return Err(BGZFError::Other {
+                        message: "Invalid virtual offset",
+                    });
+                }
+                self.write_all(&data[from..to])?;
+            } else if !block.is_empty() {
+                self.write_raw_block(&block.data)?;
+            }
+            if last {
+                return Ok(());
+            }
+        }
+        if end_offset > 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                "End of range is beyond end of data",
+            )
+            .into());
+        }
         Ok(())
     }
 
@@ -56,9 +425,17 @@ impl<W: io::Write> BGZFWriter<W> {
     /// Explicitly call of this method is not required. Drop trait will write end-of-file marker automatically.
     /// If you need to handle I/O errors while closing, please use this method.
     pub fn close(mut self) -> io::Result<()> {
+        self.finish()
+    }
+
+    /// Write remaining blocks and end-of-file marker.
+    fn finish(&mut self) -> io::Result<()> {
         if !self.closed {
-            self.flush()?;
-            self.writer.write_all(FOOTER_BYTES)?;
+            self.flush_block()?;
+            while self.write_compressed_block()? {}
+            self.output.extend_from_slice(FOOTER_BYTES);
+            self.write_output()?;
+            self.writer.flush()?;
             self.closed = true;
         }
         Ok(())
@@ -67,40 +444,129 @@ impl<W: io::Write> BGZFWriter<W> {
 
 impl<W: io::Write> io::Write for BGZFWriter<W> {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
-        self.buffer.extend_from_slice(buf);
-        while self.compress_block_unit < self.buffer.len() {
-            self.write_block()?;
+        let mut remain = buf;
+        if !self.buffer.is_empty() {
+            let fill_size = remain
+                .len()
+                .min(self.compress_block_unit - self.buffer.len());
+            self.buffer.extend_from_slice(&remain[..fill_size]);
+            remain = &remain[fill_size..];
+            if self.buffer.len() == self.compress_block_unit {
+                self.write_buffered_block()?;
+            }
         }
+        // Compress full blocks directly from the caller's slice
+        while remain.len() >= self.compress_block_unit {
+            self.write_block(&remain[..self.compress_block_unit])?;
+            remain = &remain[self.compress_block_unit..];
+        }
+        self.buffer.extend_from_slice(remain);
         Ok(buf.len())
     }
     fn flush(&mut self) -> io::Result<()> {
-        while !self.buffer.is_empty() {
-            self.write_block()?;
+        if !self.buffer.is_empty() {
+            self.write_buffered_block()?;
+        }
+        while self.write_compressed_block()? {}
+        self.write_output()?;
+        self.writer.flush()
+    }
+}
+
+/// Header of BGZF block followed by BSIZE field
+const BLOCK_HEADER: &[u8] = &[
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x04, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+];
+const BLOCK_HEADER_SIZE: usize = 18;
+const BLOCK_FOOTER_SIZE: usize = 8;
+
+/// Reusable deflater state for BGZF blocks.
+pub(crate) struct BlockCompressor {
+    deflater: Box<dyn BlockDeflater>,
+}
+
+impl BlockCompressor {
+    pub fn new(level: flate2::Compression) -> Self {
+        BlockCompressor::with_codec(&Flate2Codec, level)
+    }
+
+    pub fn with_codec(codec: &dyn DeflateCodec, level: flate2::Compression) -> Self {
+        BlockCompressor {
+            deflater: codec.deflater(level),
         }
+    }
+
+    /// Compress `data` into BGZF blocks (header, compressed data, CRC32 and size) and store them to `output`.
+    ///
+    /// Usually one block is created, but `data` is split into two or more blocks
+    /// if the compressed block does not fit into the 16-bit BSIZE field.
+    pub fn compress(&mut self, data: &[u8], output: &mut Vec<u8>) -> io::Result<()> {
+        #[cfg(feature = "tracing")]
+        let _span = tracing::trace_span!("bgzf_deflate", bytes = data.len()).entered();
+        output.clear();
+        self.append_block(data, output)
+    }
+
+    /// Compress `data` into BGZF blocks like [`BlockCompressor::compress`], and append them to `output`.
+    pub fn append(&mut self, data: &[u8], output: &mut Vec<u8>) -> io::Result<()> {
+        #[cfg(feature = "tracing")]
+        let _span = tracing::trace_span!("bgzf_deflate", bytes = data.len()).entered();
+        self.append_block(data, output)
+    }
+
+    fn append_block(&mut self, data: &[u8], output: &mut Vec<u8>) -> io::Result<()> {
+        let block_start = output.len();
+        output.extend_from_slice(BLOCK_HEADER);
+        output.extend_from_slice(&[0, 0]);
+        let fits = self.deflater.deflate(
+            data,
+            output,
+            MAX_BLOCK_SIZE - BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE,
+        )?;
+
+        if !fits {
+            output.truncate(block_start);
+            // Data up to COMPRESS_BLOCK_UNIT always fits into one block. Splitting there keeps
+            // virtual offsets reported by `bgzf_pos` for buffered data valid.
+            let split = if data.len() > COMPRESS_BLOCK_UNIT {
+                COMPRESS_BLOCK_UNIT
+            } else {
+                data.len() / 2
+            };
+            let (first, second) = data.split_at(split);
+            self.append_block(first, output)?;
+            return self.append_block(second, output);
+        }
+
+        let block_size =
+            ((output.len() - block_start + BLOCK_FOOTER_SIZE - 1) as u16).to_le_bytes();
+        output[(block_start + BLOCK_HEADER_SIZE - 2)..(block_start + BLOCK_HEADER_SIZE)]
+            .copy_from_slice(&block_size);
+
+        output.extend_from_slice(&crc32fast::hash(data).to_le_bytes());
+        output.extend_from_slice(&(data.len() as u32).to_le_bytes());
+
         Ok(())
     }
 }
 
-const FOOTER_BYTES: &[u8] = &[
+pub(crate) const FOOTER_BYTES: &[u8] = &[
     0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
     0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 ];
 
 impl<W: io::Write> Drop for BGZFWriter<W> {
     fn drop(&mut self) {
-        if !self.closed {
-            self.flush().unwrap();
-            self.writer.write_all(FOOTER_BYTES).unwrap();
-            self.closed = true;
-        }
+        self.finish().unwrap();
     }
 }
 
 #[cfg(test)]
 mod test {
     use super::*;
+    use std::convert::TryInto;
     use std::fs;
-    use std::io::Write;
+    use std::io::{BufRead, Read, Write};
 
     #[test]
     fn test_vcf() -> io::Result<()> {
@@ -124,4 +590,392 @@ mod test {
         writer.write_all(b"1234")?;
         Ok(())
     }
+
+    #[test]
+    fn test_threads() -> io::Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?)
+        .read_to_end(&mut data)?;
+
+        let mut expected = Vec::new();
+        let mut writer = BGZFWriter::new(&mut expected, flate2::Compression::default());
+        for one in data.chunks(10000) {
+            writer.write_all(one)?;
+        }
+        writer.flush()?;
+        let expected_stats = writer.stats();
+        writer.close()?;
+
+        let mut result = Vec::new();
+        let mut writer = BGZFWriter::with_threads(&mut result, flate2::Compression::default(), 4);
+        for one in data.chunks(10000) {
+            writer.write_all(one)?;
+        }
+        writer.flush()?;
+        let stats = writer.stats();
+        writer.close()?;
+
+        assert_eq!(expected, result);
+        for one in [expected_stats, stats].iter() {
+            assert_eq!(
+                one.blocks_deflated,
+                ((data.len() + COMPRESS_BLOCK_UNIT - 1) / COMPRESS_BLOCK_UNIT) as u64
+            );
+            assert_eq!(
+                one.compressed_bytes,
+                (expected.len() - FOOTER_BYTES.len()) as u64
+            );
+            assert_eq!(one.uncompressed_bytes, data.len() as u64);
+            assert!(one.codec_time > Duration::default());
+        }
+        Ok(())
+    }
+
+    /// Flate2 codec counting created deflaters and inflaters
+    #[derive(Default)]
+    struct CountingCodec {
+        deflaters: std::sync::atomic::AtomicUsize,
+        inflaters: std::sync::atomic::AtomicUsize,
+    }
+
+    impl DeflateCodec for CountingCodec {
+        fn deflater(&self, level: flate2::Compression) -> Box<dyn BlockDeflater> {
+            self.deflaters
+                .fetch_add(1, std::sync::atomic::Ordering::SeqCst);
+            Flate2Codec.deflater(level)
+        }
+        fn inflater(&self) -> Box<dyn crate::BlockInflater> {
+            self.inflaters
+                .fetch_add(1, std::sync::atomic::Ordering::SeqCst);
+            Flate2Codec.inflater()
+        }
+    }
+
+    #[test]
+    fn test_codec() -> io::Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?)
+        .read_to_end(&mut data)?;
+
+        let mut expected = Vec::new();
+        let mut writer = BGZFWriter::new(&mut expected, flate2::Compression::default());
+        writer.write_all(&data)?;
+        writer.close()?;
+
+        let codec = Arc::new(CountingCodec::default());
+        let mut result = Vec::new();
+        let mut writer = BGZFWriter::with_codec(
+            &mut result,
+            flate2::Compression::default(),
+            3,
+            codec.clone(),
+        );
+        writer.write_all(&data)?;
+        writer.close()?;
+        assert_eq!(expected, result);
+        assert_eq!(codec.deflaters.load(std::sync::atomic::Ordering::SeqCst), 4);
+
+        let mut reader = crate::BGZFReader::with_codec(io::Cursor::new(&result), 2, codec.clone());
+        let mut inflated = Vec::new();
+        reader.read_to_end(&mut inflated)?;
+        assert_eq!(inflated, data);
+        assert_eq!(codec.inflaters.load(std::sync::atomic::Ordering::SeqCst), 3);
+        Ok(())
+    }
+
+    /// A writer which counts calls of `write`
+    struct CountingWriter {
+        data: Vec<u8>,
+        writes: usize,
+    }
+
+    impl Write for CountingWriter {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.writes += 1;
+            self.data.extend_from_slice(buf);
+            Ok(buf.len())
+        }
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_output_buffer() -> io::Result<()> {
+        let data: Vec<u8> = (0..2_000_000u32).map(|x| (x % 251) as u8).collect();
+        let mut expected = Vec::new();
+        for threads in [1, 3].iter() {
+            for size in [0, 100_000, DEFAULT_OUTPUT_BUFFER_SIZE].iter() {
+                let mut output = CountingWriter {
+                    data: Vec::new(),
+                    writes: 0,
+                };
+                let mut writer =
+                    BGZFWriter::with_threads(&mut output, flate2::Compression::default(), *threads);
+                writer.set_output_buffer_size(*size)?;
+                writer.write_all(&data)?;
+                writer.flush()?;
+                let stats = writer.stats();
+                writer.close()?;
+
+                let blocks = stats.blocks_deflated as usize;
+                if *size == 0 {
+                    assert_eq!(output.writes, blocks + 1);
+                    expected = output.data;
+                } else {
+                    // Full batches, the rest written by flush and end-of-file marker
+                    assert!(output.writes <= output.data.len() / size + 2);
+                    assert_eq!(output.data, expected);
+                }
+            }
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_large_write() -> io::Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?)
+        .read_to_end(&mut data)?;
+        let data = &data[..1024 * 1024 + 10];
+
+        let mut expected = Vec::new();
+        let mut writer = BGZFWriter::new(&mut expected, flate2::Compression::default());
+        for one in data.chunks(100) {
+            writer.write_all(one)?;
+        }
+        writer.close()?;
+
+        for threads in [1, 3].iter() {
+            let mut result = Vec::new();
+            let mut writer =
+                BGZFWriter::with_threads(&mut result, flate2::Compression::default(), *threads);
+            writer.write_all(&data[..10])?;
+            writer.write_all(&data[10..])?;
+            writer.close()?;
+            assert_eq!(expected, result);
+        }
+
+        let mut decompressed = Vec::new();
+        flate2::read::MultiGzDecoder::new(&expected[..]).read_to_end(&mut decompressed)?;
+        assert_eq!(data, &decompressed[..]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_block_size() -> io::Result<()> {
+        // Incompressible data
+        let mut data = Vec::new();
+        let mut x: u32 = 1;
+        for _ in 0..300_000 {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            data.push(x as u8);
+        }
+
+        for (size, level) in [
+            (MAX_BLOCK_SIZE, flate2::Compression::none()),
+            (MAX_BLOCK_SIZE, flate2::Compression::default()),
+            (1000, flate2::Compression::fast()),
+        ]
+        .iter()
+        {
+            let mut result = Vec::new();
+            let mut writer = BGZFWriter::new(&mut result, *level);
+            writer.set_block_size(*size)?;
+            writer.write_all(&data)?;
+            writer.close()?;
+
+            let mut reader = io::BufReader::new(&result[..]);
+            loop {
+                let header = crate::header::BGZFHeader::from_reader(&mut reader).unwrap();
+                let block_size = header.block_size().unwrap() as usize + 1;
+                assert!(block_size <= MAX_BLOCK_SIZE);
+                let mut block = vec![0; block_size - header.header_size() as usize];
+                reader.read_exact(&mut block)?;
+                let isize = u32::from_le_bytes(block[block.len() - 4..].try_into().unwrap());
+                assert!(isize as usize <= *size);
+                if isize == 0 {
+                    break;
+                }
+            }
+
+            let mut decompressed = Vec::new();
+            crate::BGZFReader::new(io::Cursor::new(&result)).read_to_end(&mut decompressed)?;
+            assert_eq!(data, decompressed);
+        }
+
+        let mut writer = BGZFWriter::new(Vec::new(), flate2::Compression::default());
+        assert!(writer.set_block_size(0).is_err());
+        assert!(writer.set_block_size(MAX_BLOCK_SIZE + 1).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_gzi() -> io::Result<()> {
+        let mut data = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz",
+        )?)
+        .read_to_end(&mut data)?;
+        let expected = crate::gzi::GZI::from_reader(&mut fs::File::open(
+            "testfiles/common_all_20180418_half.vcf.gz.gzi",
+        )?)?;
+
+        let mut indexes = Vec::new();
+        for threads in [1, 4].iter() {
+            let mut result = Vec::new();
+            let mut writer =
+                BGZFWriter::with_threads(&mut result, flate2::Compression::default(), *threads);
+            writer.enable_gzi();
+            for one in data.chunks(10000) {
+                writer.write_all(one)?;
+            }
+            writer.flush()?;
+            let gzi = writer.gzi().unwrap().clone();
+            writer.close()?;
+
+            let uncompressed: Vec<_> = gzi.entries.iter().map(|x| x.uncompressed_offset).collect();
+            let expected_uncompressed: Vec<_> = expected
+                .entries
+                .iter()
+                .map(|x| x.uncompressed_offset)
+                .collect();
+            assert_eq!(uncompressed, expected_uncompressed);
+
+            let mut reader = crate::BGZFReader::new(io::Cursor::new(&result));
+            for one in &gzi.entries {
+                reader
+                    .bgzf_seek(one.compressed_offset << 16)
+                    .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+                let offset = one.uncompressed_offset as usize;
+                assert_eq!(
+                    reader.fill_buf()?,
+                    &data[offset..(offset + 65280).min(data.len())]
+                );
+            }
+            reader.set_gzi(gzi.clone());
+            reader
+                .seek_uncompressed(1_234_567)
+                .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+            let mut buffer = [0; 100];
+            reader.read_exact(&mut buffer)?;
+            assert_eq!(&buffer[..], &data[1_234_567..1_234_667]);
+            indexes.push(gzi);
+        }
+        assert_eq!(indexes[0], indexes[1]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_bgzf_pos() -> io::Result<()> {
+        // Incompressible data is split into two blocks with 64KiB block size
+        let mut state: u32 = 1;
+        let random: Vec<u8> = (0..300_000)
+            .map(|_| {
+                state = state.wrapping_mul(1_103_515_245).wrapping_add(12345);
+                (state >> 16) as u8
+            })
+            .collect();
+        for (threads, size, level) in [
+            (1, COMPRESS_BLOCK_UNIT, flate2::Compression::default()),
+            (4, COMPRESS_BLOCK_UNIT, flate2::Compression::default()),
+            (1, MAX_BLOCK_SIZE, flate2::Compression::none()),
+            (3, MAX_BLOCK_SIZE, flate2::Compression::none()),
+        ]
+        .iter()
+        {
+            let mut result = Vec::new();
+            let mut writer = BGZFWriter::with_threads(&mut result, *level, *threads);
+            writer.set_block_size(*size)?;
+            let mut positions = Vec::new();
+            for (i, one) in random.chunks(7777).enumerate() {
+                positions.push((writer.bgzf_pos()?, one));
+                writer.write_all(one)?;
+                if i % 10 == 0 {
+                    writer.flush_block()?;
+                    assert_eq!(writer.bgzf_pos()? & 0xffff, 0);
+                }
+            }
+            writer.close()?;
+
+            let mut reader = crate::BGZFReader::new(io::Cursor::new(&result));
+            let mut buffer = vec![0; 7777];
+            for (position, expected) in positions.iter().rev() {
+                reader
+                    .bgzf_seek(*position)
+                    .map_err(|x| io::Error::new(io::ErrorKind::Other, x))?;
+                reader.read_exact(&mut buffer[..expected.len()])?;
+                assert_eq!(&buffer[..expected.len()], *expected);
+            }
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn test_raw_copy() -> Result<(), crate::BGZFError> {
+        let data = fs::read("testfiles/common_all_20180418_half.vcf.gz")?;
+        let mut expected = Vec::new();
+        flate2::read::MultiGzDecoder::new(&data[..]).read_to_end(&mut expected)?;
+        let blocks: Vec<crate::BGZFRawBlock> =
+            BGZFBlocks::new(&data[..]).collect::<Result<_, _>>()?;
+        let mut block_starts = Vec::new();
+        let mut uncompressed = 0;
+        for one in &blocks {
+            block_starts.push(uncompressed);
+            uncompressed += u64::from(one.uncompressed_size()) as usize;
+        }
+
+        let mut merged = Vec::new();
+        let mut writer = BGZFWriter::new(&mut merged, flate2::Compression::default());
+        writer.append_bgzf(&data[..])?;
+        writer.append_bgzf(&data[..])?;
+        writer.close()?;
+        assert_eq!(
+            merged.len(),
+            (data.len() - FOOTER_BYTES.len()) * 2 + FOOTER_BYTES.len()
+        );
+
+        // (block index, offset in block) of beginning and end
+        for (begin, end) in [
+            ((3, 100), (10, 5000)),
+            ((2, 0), (5, 0)),
+            ((4, 10), (4, 20000)),
+            ((5, 30000), (6, 0)),
+        ]
+        .iter()
+        {
+            let mut result = Vec::new();
+            let mut writer = BGZFWriter::new(&mut result, flate2::Compression::default());
+            writer.write_all(b"header\n")?;
+            writer.append_bgzf_range(
+                io::Cursor::new(&data),
+                blocks[begin.0].position << 16 | begin.1,
+                blocks[end.0].position << 16 | end.1,
+            )?;
+            writer.close()?;
+
+            let mut spliced = Vec::new();
+            crate::BGZFReader::new(io::Cursor::new(&result)).read_to_end(&mut spliced)?;
+            let from = block_starts[begin.0] + begin.1 as usize;
+            let to = block_starts[end.0] + end.1 as usize;
+            assert_eq!(&spliced[..7], b"header\n");
+            assert_eq!(&spliced[7..], &expected[from..to]);
+            if begin.1 == 0 && end.1 == 0 {
+                // Whole blocks are copied as is
+                let copied = (blocks[end.0].position - blocks[begin.0].position) as usize;
+                assert!(result
+                    .windows(copied)
+                    .any(|x| x == &data[(blocks[begin.0].position as usize)..][..copied]));
+            }
+        }
+        Ok(())
+    }
 }